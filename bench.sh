@@ -0,0 +1,247 @@
+#!/bin/sh
+#
+# genimage benchmark, run by 'make bench'
+#
+# Generates synthetic root filesystems and layouts, builds images from them
+# with genimage several times and appends the best result of each image to
+# a results file, one line per image:
+#
+#   date  revision  dataset  image  handler  ms  MB/s  files/s  peak-RSS-KiB
+#
+# MB/s is the output size divided by the time of the generate phase,
+# files/s the number of files in the dataset divided by the same time.
+# The peak RSS is that of genimage or the tools it runs, whichever is
+# larger. Images whose tools are not installed are skipped.
+#
+# Environment:
+#   GENIMAGE       genimage binary (default: ./genimage)
+#   BENCH_DIR      work directory (default: ./bench-work)
+#   BENCH_RESULTS  results file (default: ./bench-results.txt)
+#   BENCH_RUNS     runs per dataset (default: 3)
+#   BENCH_SCALE    size factor for the datasets (default: 1)
+#   BENCH_JOBS     genimage --jobs (default: 1)
+
+set -e
+
+GENIMAGE="${GENIMAGE:-./genimage}"
+BENCH_DIR="${BENCH_DIR:-./bench-work}"
+BENCH_RESULTS="${BENCH_RESULTS:-./bench-results.txt}"
+BENCH_RUNS="${BENCH_RUNS:-3}"
+BENCH_SCALE="${BENCH_SCALE:-1}"
+BENCH_JOBS="${BENCH_JOBS:-1}"
+
+srcdir="$(cd "$(dirname "$0")" && pwd)"
+date="$(date +%Y-%m-%dT%H:%M:%S)"
+rev="$(git -C "${srcdir}" describe --always --dirty 2>/dev/null || echo unknown)"
+
+have() {
+	command -v "$1" >/dev/null 2>&1
+}
+
+# many tiny files
+gen_tiny() {
+	n=$((10000 * BENCH_SCALE))
+	i=0
+	while [ $i -lt $n ]; do
+		d="$1/dir$((i % 100))"
+		[ -d "$d" ] || mkdir -p "$d"
+		echo "file $i" > "$d/f$i"
+		i=$((i + 1))
+	done
+}
+
+# few huge files, one of them mostly holes
+gen_huge() {
+	mkdir -p "$1"
+	for i in 1 2 3; do
+		dd if=/dev/urandom of="$1/huge$i" bs=1M count=$((32 * BENCH_SCALE)) 2>/dev/null
+	done
+	dd if=/dev/urandom of="$1/sparse" bs=1M count=1 seek=$((64 * BENCH_SCALE)) 2>/dev/null
+}
+
+# deep directory nesting
+gen_deep() {
+	for b in $(seq 1 $((20 * BENCH_SCALE))); do
+		d="$1/b$b"
+		for l in $(seq 1 64); do
+			d="$d/l$l"
+		done
+		mkdir -p "$d"
+		d="$1/b$b"
+		for l in $(seq 1 64); do
+			d="$d/l$l"
+			echo "$b $l" > "$d/f"
+		done
+	done
+}
+
+# every file has ten links
+gen_hardlink() {
+	mkdir -p "$1/files"
+	for i in $(seq 1 $((1000 * BENCH_SCALE))); do
+		echo "file $i" > "$1/files/f$i"
+		for l in $(seq 1 9); do
+			mkdir -p "$1/links$l"
+			ln "$1/files/f$i" "$1/links$l/f$i"
+		done
+	done
+}
+
+# size in KiB to give filesystems room for a dataset
+fs_size() {
+	echo $(( $(du -sk "$1" | cut -f1) * 2 + 16384 ))
+}
+
+config_paths() {
+	cat <<-EOF
+	config {
+		rootpath = "$1"
+		tmppath = "${BENCH_DIR}/tmp"
+		inputpath = "${BENCH_DIR}/input"
+		outputpath = "${BENCH_DIR}/out"
+	}
+	EOF
+}
+
+# the filesystem images for a dataset
+config_fs() {
+	size=$(fs_size "$1")K
+
+	echo 'image bench.tar { tar {} }'
+	have cpio && echo 'image bench.cpio { cpio {} }'
+	have mksquashfs && echo 'image bench.squashfs { squashfs {} }'
+	have mke2fs && cat <<-EOF
+	image bench.ext4 {
+		ext4 { use-mke2fs = true }
+		size = ${size}
+	}
+	EOF
+	have mkdosfs && have mcopy && cat <<-EOF
+	image bench.vfat {
+		vfat {}
+		size = ${size}
+	}
+	EOF
+	config_paths "$1"
+}
+
+# partition layouts from blobs in the input path
+config_layout() {
+	cat <<-EOF
+	include("${srcdir}/flash.conf")
+	image blob.bin { file {} }
+	image sparse.bin { file {} }
+	image bench.hdimage {
+		hdimage {}
+		partition a { image = "blob.bin" partition-type = 0x83 offset = 1M }
+		partition b { image = "sparse.bin" partition-type = 0x83 }
+		partition c { image = "blob.bin" partition-type = 0x83 }
+		partition d { image = "sparse.bin" partition-type = 0x83 }
+		partition e { image = "blob.bin" partition-type = 0x83 }
+	}
+	image bench.flash {
+		flash {}
+		flashtype = "nand-64M-512"
+		partition a { image = "blob.bin" size = 24M }
+		partition b { image = "sparse.bin" size = 0 }
+	}
+	image bench.ubi {
+		ubi {}
+		flashtype = "nand-64M-512"
+		partition a { image = "blob.bin" size = 24M }
+		partition b { image = "sparse.bin" size = 24M }
+	}
+	EOF
+	config_paths "$1"
+}
+
+gen_layout_input() {
+	mkdir -p "${BENCH_DIR}/input"
+	dd if=/dev/urandom of="${BENCH_DIR}/input/blob.bin" bs=1M count=16 2>/dev/null
+	rm -f "${BENCH_DIR}/input/sparse.bin"
+	dd if=/dev/urandom of="${BENCH_DIR}/input/sparse.bin" bs=1M count=1 seek=15 2>/dev/null
+}
+
+# print "image handler generate-us peak-rss-kb" from a --stats file
+parse_stats() {
+	awk '
+	function field(name,    s) {
+		if (!match($0, "\"" name "\": \"?[^,\"}]*"))
+			return ""
+		s = substr($0, RSTART, RLENGTH)
+		sub("^\"" name "\": \"?", "", s)
+		return s
+	}
+	/^\t\t\t"image": / { image = field("image") }
+	/^\t\t\t"type": / { type = field("type") }
+	/"phase": "generate"/ {
+		us[image] = field("wall_us")
+		types[image] = type
+	}
+	/"(phase|tool)": / {
+		rss = field("max_rss_kb") + field("peak_rss_kb_so_far")
+		if (rss > peak[image])
+			peak[image] = rss
+	}
+	END {
+		for (i in us)
+			print i, types[i], us[i], peak[i] + 0
+	}' "$1"
+}
+
+# run_config <dataset> <config> <number of files>
+run_config() {
+	best="${BENCH_DIR}/best"
+	: > "${best}"
+
+	for run in $(seq 1 "${BENCH_RUNS}"); do
+		rm -rf "${BENCH_DIR}/tmp" "${BENCH_DIR}/out"
+		if ! "${GENIMAGE}" --config "$2" --jobs "${BENCH_JOBS}" \
+				--stats "${BENCH_DIR}/stats.json" \
+				--loglevel 0 >"${BENCH_DIR}/log" 2>&1; then
+			cat "${BENCH_DIR}/log" >&2
+			echo "bench: $1 failed" >&2
+			return 1
+		fi
+		parse_stats "${BENCH_DIR}/stats.json" >> "${best}"
+	done
+
+	sort -k1,1 -k3,3n "${best}" | awk '!seen[$1]++' |
+	while read image handler us rss; do
+		case "${image}" in bench.*) ;; *) continue ;; esac
+		bytes=$(stat -c %s "${BENCH_DIR}/out/${image}")
+		[ "${us}" -gt 0 ] || us=1
+		mbs=$(awk "BEGIN { printf \"%.1f\", ${bytes} / ${us} }")
+		if [ "$3" -gt 0 ]; then
+			fps=$(awk "BEGIN { printf \"%.0f\", $3 * 1000000 / ${us} }")
+		else
+			fps=-
+		fi
+		ms=$(awk "BEGIN { printf \"%.1f\", ${us} / 1000 }")
+		printf "%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n" "${date}" "${rev}" \
+			"$1" "${image}" "${handler}" "${ms}" "${mbs}" "${fps}" "${rss}" |
+			tee -a "${BENCH_RESULTS}"
+	done
+}
+
+rm -rf "${BENCH_DIR}"
+mkdir -p "${BENCH_DIR}/input"
+
+[ -s "${BENCH_RESULTS}" ] ||
+	printf "# date\trevision\tdataset\timage\thandler\tms\tMB/s\tfiles/s\tpeak-RSS-KiB\n" > "${BENCH_RESULTS}"
+
+for dataset in tiny huge deep hardlink; do
+	root="${BENCH_DIR}/root-${dataset}"
+	echo "bench: generating ${dataset} dataset" >&2
+	gen_${dataset} "${root}"
+	config_fs "${root}" > "${BENCH_DIR}/${dataset}.cfg"
+	run_config "${dataset}" "${BENCH_DIR}/${dataset}.cfg" \
+		"$(find "${root}" | wc -l)"
+done
+
+mkdir -p "${BENCH_DIR}/root-empty"
+gen_layout_input
+config_layout "${BENCH_DIR}/root-empty" > "${BENCH_DIR}/layout.cfg"
+run_config layout "${BENCH_DIR}/layout.cfg" 0
+
+rm -rf "${BENCH_DIR}"
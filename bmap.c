@@ -0,0 +1,282 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <confuse.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "genimage.h"
+#include "sha256.h"
+
+/*
+ * Block maps in the format of bmaptool (version 2.0). They list the
+ * blocks of an image which carry data, so that flashing can skip the
+ * rest. The handlers describe the mapped areas from their partition
+ * layout, holes in the partition images are left out.
+ */
+
+#define BMAP_BLOCK_SIZE	4096
+
+struct bmap_range {
+	unsigned long long first, last;	/* blocks */
+	char chksum[2 * SHA256_DIGEST_SIZE + 1];
+};
+
+struct bmap {
+	struct bmap_range *ranges;
+	int num;
+	const char *file;
+	unsigned long long size;
+};
+
+struct bmap *bmap_new(void)
+{
+	return xzalloc(sizeof(struct bmap));
+}
+
+void bmap_free(struct bmap *bmap)
+{
+	free(bmap->ranges);
+	free(bmap);
+}
+
+/*
+ * mark the bytes from 'start' up to 'end' as mapped
+ */
+void bmap_add_range(struct bmap *bmap, unsigned long long start,
+		unsigned long long end)
+{
+	struct bmap_range *r;
+
+	if (end <= start)
+		return;
+
+	bmap->ranges = realloc(bmap->ranges, (bmap->num + 1) * sizeof(*r));
+	if (!bmap->ranges) {
+		error("out of memory\n");
+		exit(1);
+	}
+
+	r = &bmap->ranges[bmap->num++];
+	r->first = start / BMAP_BLOCK_SIZE;
+	r->last = (end - 1) / BMAP_BLOCK_SIZE;
+}
+
+/*
+ * mark the data of 'file' placed at 'offset' as mapped, leaving out its holes
+ */
+int bmap_add_file(struct bmap *bmap, const char *file, unsigned long long offset)
+{
+	off_t data, hole = 0, end;
+	struct stat s;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &s)) {
+		close(fd);
+		return -errno;
+	}
+	end = s.st_size;
+
+	while (hole < end) {
+		data = lseek(fd, hole, SEEK_DATA);
+		if (data < 0) {
+			if (errno == ENXIO)
+				break;
+			/* no hole detection, everything is data */
+			data = hole;
+			hole = end;
+		} else {
+			hole = lseek(fd, data, SEEK_HOLE);
+			if (hole < 0 || hole > end)
+				hole = end;
+		}
+		bmap_add_range(bmap, offset + data, offset + hole);
+	}
+
+	close(fd);
+
+	return 0;
+}
+
+static int bmap_cmp(const void *a, const void *b)
+{
+	const struct bmap_range *ra = a, *rb = b;
+
+	if (ra->first != rb->first)
+		return ra->first < rb->first ? -1 : 1;
+	return 0;
+}
+
+/*
+ * sort the ranges and merge overlapping and adjacent ones
+ */
+static void bmap_merge(struct bmap *bmap)
+{
+	int i, num = 0;
+
+	qsort(bmap->ranges, bmap->num, sizeof(*bmap->ranges), bmap_cmp);
+
+	for (i = 0; i < bmap->num; i++) {
+		struct bmap_range *r = &bmap->ranges[i];
+
+		if (num && r->first <= bmap->ranges[num - 1].last + 1) {
+			if (r->last > bmap->ranges[num - 1].last)
+				bmap->ranges[num - 1].last = r->last;
+			continue;
+		}
+		bmap->ranges[num++] = *r;
+	}
+
+	bmap->num = num;
+}
+
+static int bmap_checksum_range(void *priv, int i)
+{
+	struct bmap *bmap = priv;
+	struct bmap_range *r = &bmap->ranges[i];
+	unsigned char digest[SHA256_DIGEST_SIZE];
+	unsigned long long offset = r->first * BMAP_BLOCK_SIZE;
+	unsigned long long end = (r->last + 1) * BMAP_BLOCK_SIZE;
+	struct sha256_ctx ctx;
+	char *buf;
+	int fd, ret = 0;
+
+	if (end > bmap->size)
+		end = bmap->size;
+
+	fd = open(bmap->file, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	buf = xzalloc(1024 * 1024);
+	sha256_init(&ctx);
+
+	while (offset < end) {
+		size_t now = end - offset > 1024 * 1024 ? 1024 * 1024 : end - offset;
+		ssize_t len = pread(fd, buf, now, offset);
+
+		if (len <= 0) {
+			ret = len < 0 ? -errno : -EIO;
+			break;
+		}
+		sha256_update(&ctx, buf, len);
+		offset += len;
+	}
+
+	sha256_final(&ctx, digest);
+	sha256_hex(digest, r->chksum);
+
+	free(buf);
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * write the block map for the output of 'image' to '<outfile>.bmap'
+ */
+int bmap_write(struct image *image, struct bmap *bmap)
+{
+	unsigned char digest[SHA256_DIGEST_SIZE];
+	char hex[2 * SHA256_DIGEST_SIZE + 1];
+	unsigned long long mapped = 0;
+	struct sha256_ctx ctx;
+	char *buf = NULL, *sum, *file;
+	size_t size = 0;
+	struct stat s;
+	FILE *f;
+	int i, ret;
+
+	bmap->file = imageoutfile(image);
+	if (stat(bmap->file, &s))
+		return -errno;
+	bmap->size = s.st_size;
+
+	bmap_merge(bmap);
+
+	/* drop what is beyond the end of the image */
+	while (bmap->num && bmap->ranges[bmap->num - 1].first * BMAP_BLOCK_SIZE >= bmap->size)
+		bmap->num--;
+	if (bmap->num && bmap->ranges[bmap->num - 1].last * BMAP_BLOCK_SIZE >= bmap->size)
+		bmap->ranges[bmap->num - 1].last = (bmap->size - 1) / BMAP_BLOCK_SIZE;
+
+	ret = run_parallel(bmap->num, bmap_checksum_range, bmap);
+	if (ret) {
+		image_error(image, "failed to read %s: %s\n", bmap->file,
+				strerror(-ret));
+		return ret;
+	}
+
+	for (i = 0; i < bmap->num; i++)
+		mapped += bmap->ranges[i].last - bmap->ranges[i].first + 1;
+
+	f = open_memstream(&buf, &size);
+	if (!f)
+		return -errno;
+
+	fprintf(f, "<?xml version=\"1.0\" ?>\n");
+	fprintf(f, "<!-- generated by genimage for %s -->\n", image->file);
+	fprintf(f, "<bmap version=\"2.0\">\n");
+	fprintf(f, "\t<ImageSize> %llu </ImageSize>\n", bmap->size);
+	fprintf(f, "\t<BlockSize> %u </BlockSize>\n", BMAP_BLOCK_SIZE);
+	fprintf(f, "\t<BlocksCount> %llu </BlocksCount>\n",
+			(bmap->size + BMAP_BLOCK_SIZE - 1) / BMAP_BLOCK_SIZE);
+	fprintf(f, "\t<MappedBlocksCount> %llu </MappedBlocksCount>\n", mapped);
+	fprintf(f, "\t<ChecksumType> sha256 </ChecksumType>\n");
+	fprintf(f, "\t<BmapFileChecksum> %0*d </BmapFileChecksum>\n",
+			2 * SHA256_DIGEST_SIZE, 0);
+	fprintf(f, "\t<BlockMap>\n");
+	for (i = 0; i < bmap->num; i++) {
+		struct bmap_range *r = &bmap->ranges[i];
+
+		if (r->first == r->last)
+			fprintf(f, "\t\t<Range chksum=\"%s\"> %llu </Range>\n",
+					r->chksum, r->first);
+		else
+			fprintf(f, "\t\t<Range chksum=\"%s\"> %llu-%llu </Range>\n",
+					r->chksum, r->first, r->last);
+	}
+	fprintf(f, "\t</BlockMap>\n");
+	fprintf(f, "</bmap>\n");
+	fclose(f);
+
+	/* the file checksum is calculated with the checksum field zeroed */
+	sha256_init(&ctx);
+	sha256_update(&ctx, buf, size);
+	sha256_final(&ctx, digest);
+	sha256_hex(digest, hex);
+	sum = strstr(buf, "<BmapFileChecksum> ") + strlen("<BmapFileChecksum> ");
+	memcpy(sum, hex, 2 * SHA256_DIGEST_SIZE);
+
+	asprintf(&file, "%s.bmap", imageoutfile(image));
+	image_log(image, 1, "writing block map %s (%llu of %llu blocks mapped)\n",
+			file, mapped, (bmap->size + BMAP_BLOCK_SIZE - 1) / BMAP_BLOCK_SIZE);
+
+	unlink(file);
+	ret = insert_data(image, buf, file, size, 0);
+
+	free(file);
+	free(buf);
+
+	return ret;
+}
@@ -0,0 +1,567 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <confuse.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "genimage.h"
+#include "sha256.h"
+
+/*
+ * Output cache
+ *
+ * When 'cachepath' is set, each generated image is stored in the cache
+ * directory under a key which is the SHA-256 of everything the output
+ * depends on:
+ *
+ * - the image type, its options and its partitions
+ * - the keys of all images referenced by its partitions
+ * - the metadata and contents of the files below its mountpoint
+ * - the external programs it may call
+ *
+ * Images found in the cache are restored by reflink or copy instead of
+ * being generated again. They are never hardlinked, so that writing to
+ * an output does not change the cache entry and vice versa.
+ */
+
+#define CACHE_VERSION	"genimage-cache-2"
+
+struct tree_digest {
+	char *path;
+	unsigned char digest[SHA256_DIGEST_SIZE];
+	struct list_head list;
+};
+
+static LIST_HEAD(tree_digests);
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char tools_digest[SHA256_DIGEST_SIZE];
+static int tools_digest_valid;
+
+static const char *cachepath(void)
+{
+	return get_opt("cachepath");
+}
+
+static void hash_str(struct sha256_ctx *ctx, const char *str)
+{
+	str = str ? : "";
+	sha256_update(ctx, str, strlen(str) + 1);
+}
+
+static void hash_fmt(struct sha256_ctx *ctx, const char *fmt, ...)
+{
+	va_list args;
+	char *buf;
+
+	va_start(args, fmt);
+	vasprintf(&buf, fmt, args);
+	va_end(args);
+
+	hash_str(ctx, buf);
+	free(buf);
+}
+
+static int hash_file(struct sha256_ctx *ctx, const char *file)
+{
+	char buf[65536];
+	ssize_t r;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	while ((r = read(fd, buf, sizeof(buf))) > 0)
+		sha256_update(ctx, buf, r);
+
+	close(fd);
+
+	return r < 0 ? -EIO : 0;
+}
+
+static int hash_tree(struct sha256_ctx *ctx, const char *path, const char *rel);
+
+static int hash_entry(struct sha256_ctx *ctx, const char *path, const char *rel,
+		const struct stat *s)
+{
+	hash_fmt(ctx, "%s %o %u %u", rel, s->st_mode, s->st_uid, s->st_gid);
+	if (S_ISREG(s->st_mode)) {
+		int ret;
+
+		hash_fmt(ctx, "%lld %lld.%09ld", (long long)s->st_size,
+				(long long)s->st_mtim.tv_sec, s->st_mtim.tv_nsec);
+		ret = hash_file(ctx, path);
+		if (ret)
+			return ret;
+	}
+	if (S_ISCHR(s->st_mode) || S_ISBLK(s->st_mode))
+		hash_fmt(ctx, "%llx", (unsigned long long)s->st_rdev);
+	if (S_ISLNK(s->st_mode)) {
+		char target[PATH_MAX];
+		ssize_t len = readlink(path, target, sizeof(target) - 1);
+
+		if (len >= 0) {
+			target[len] = '\0';
+			hash_str(ctx, target);
+		}
+	}
+	if (S_ISDIR(s->st_mode))
+		return hash_tree(ctx, path, rel);
+
+	return 0;
+}
+
+/*
+ * hash the metadata and the contents of all files below 'path' in sorted
+ * order. Directory mtimes are left out as the mountpoint directories are
+ * created freshly for every run. Contents are hashed, not only size and
+ * mtime, as these are often preserved or clamped when files change.
+ */
+static int hash_tree(struct sha256_ctx *ctx, const char *path, const char *rel)
+{
+	struct dirent **names;
+	int i, n, ret = 0;
+
+	n = scandir(path, &names, NULL, alphasort);
+	if (n < 0)
+		return -errno;
+
+	for (i = 0; i < n; i++) {
+		const char *name = names[i]->d_name;
+		char *fullpath, *relpath;
+		struct stat s;
+
+		if (ret || !strcmp(name, ".") || !strcmp(name, ".."))
+			goto next;
+
+		asprintf(&fullpath, "%s/%s", path, name);
+		asprintf(&relpath, "%s/%s", rel, name);
+
+		if (lstat(fullpath, &s))
+			ret = -errno;
+		else
+			ret = hash_entry(ctx, fullpath, relpath, &s);
+
+		free(fullpath);
+		free(relpath);
+next:
+		free(names[i]);
+	}
+	free(names);
+
+	return ret;
+}
+
+/*
+ * hex digest of the metadata and contents of 'path' and everything below
+ * it, like the cache keys use it
+ */
+int cache_tree_digest(const char *path, char *hex)
+{
+	unsigned char digest[SHA256_DIGEST_SIZE];
+	struct sha256_ctx ctx;
+	struct stat s;
+	int ret;
+
+	if (lstat(path, &s))
+		return -errno;
+
+	sha256_init(&ctx);
+	ret = hash_entry(&ctx, path, "", &s);
+	if (ret)
+		return ret;
+	sha256_final(&ctx, digest);
+	sha256_hex(digest, hex);
+
+	return 0;
+}
+
+static int get_tree_digest(const char *path, unsigned char *digest)
+{
+	struct tree_digest *t;
+	struct sha256_ctx ctx;
+	int ret = 0;
+
+	pthread_mutex_lock(&cache_lock);
+
+	list_for_each_entry(t, &tree_digests, list) {
+		if (!strcmp(t->path, path))
+			goto out;
+	}
+
+	sha256_init(&ctx);
+	ret = hash_tree(&ctx, path, "");
+	if (ret)
+		goto unlock;
+
+	t = xzalloc(sizeof(*t));
+	t->path = strdup(path);
+	sha256_final(&ctx, t->digest);
+	list_add_tail(&t->list, &tree_digests);
+out:
+	memcpy(digest, t->digest, SHA256_DIGEST_SIZE);
+unlock:
+	pthread_mutex_unlock(&cache_lock);
+
+	return ret;
+}
+
+/*
+ * find the program an option refers to. Returns 0 if 'value' is
+ * an executable, either directly or found in $PATH.
+ */
+static int find_program(const char *value, struct stat *s, char **path)
+{
+	char *prog, *dirs, *dir, *saveptr;
+	const char *env = getenv("PATH");
+	int ret = -ENOENT;
+
+	prog = strndup(value, strcspn(value, " \t"));
+
+	if (strchr(prog, '/')) {
+		if (!stat(prog, s) && S_ISREG(s->st_mode) && !access(prog, X_OK)) {
+			*path = strdup(prog);
+			ret = 0;
+		}
+		free(prog);
+		return ret;
+	}
+
+	dirs = strdup(env ? : "/usr/bin:/bin");
+	for (dir = strtok_r(dirs, ":", &saveptr); dir;
+			dir = strtok_r(NULL, ":", &saveptr)) {
+		asprintf(path, "%s/%s", dir, prog);
+		if (!stat(*path, s) && S_ISREG(s->st_mode) && !access(*path, X_OK)) {
+			ret = 0;
+			break;
+		}
+		free(*path);
+	}
+
+	free(dirs);
+	free(prog);
+
+	return ret;
+}
+
+static int hash_program(const char *name, const char *value, void *priv)
+{
+	struct sha256_ctx *ctx = priv;
+	struct stat s;
+	char *path;
+
+	if (!value || find_program(value, &s, &path))
+		return 0;
+
+	hash_fmt(ctx, "%s %s %s %lld %lld", name, value, path,
+			(long long)s.st_size, (long long)s.st_mtime);
+	free(path);
+
+	return 0;
+}
+
+/*
+ * External programs are identified by path, size and mtime, so that
+ * installing a different version invalidates the cache.
+ */
+static void get_tools_digest(unsigned char *digest)
+{
+	struct sha256_ctx ctx;
+
+	pthread_mutex_lock(&cache_lock);
+	if (!tools_digest_valid) {
+		sha256_init(&ctx);
+		for_each_opt(hash_program, &ctx);
+		sha256_final(&ctx, tools_digest);
+		tools_digest_valid = 1;
+	}
+	memcpy(digest, tools_digest, SHA256_DIGEST_SIZE);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+static int hash_section(struct sha256_ctx *ctx, cfg_t *sec)
+{
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *f;
+
+	f = open_memstream(&buf, &size);
+	if (!f)
+		return -errno;
+	if (sec)
+		cfg_print(sec, f);
+	fclose(f);
+
+	sha256_update(ctx, buf, size);
+	free(buf);
+
+	return 0;
+}
+
+static int image_digest(struct image *image, char **key)
+{
+	unsigned char digest[SHA256_DIGEST_SIZE];
+	char hex[2 * SHA256_DIGEST_SIZE + 1];
+	struct sha256_ctx ctx;
+	struct partition *part;
+	int ret;
+
+	sha256_init(&ctx);
+	hash_str(&ctx, CACHE_VERSION);
+	hash_str(&ctx, image->handler->type);
+	hash_str(&ctx, image->file);
+	hash_str(&ctx, image->name);
+	hash_fmt(&ctx, "%llu", image->size);
+	hash_str(&ctx, image->mountpoint);
+	hash_str(&ctx, image->exec_pre);
+	hash_str(&ctx, image->exec_post);
+	if (image->flash_type) {
+		struct flash_type *f = image->flash_type;
+
+		hash_fmt(&ctx, "%d %d %d %d %d %d %d", f->pebsize, f->lebsize,
+				f->numpebs, f->minimum_io_unit_size,
+				f->vid_header_offset, f->sub_page_size,
+				f->oob_size);
+	}
+
+	ret = hash_section(&ctx, image->imagesec);
+	if (ret)
+		return ret;
+
+	list_for_each_entry(part, &image->partitions, list) {
+		hash_fmt(&ctx, "%s %llu %llu %u %d %d %d %d %d %s",
+				part->name, part->offset, part->size,
+				part->partition_type, part->bootable,
+				part->extended, part->read_only,
+				part->autoresize, part->in_partition_table,
+				part->image);
+		if (part->image) {
+			struct image *child = image_get(part->image);
+
+			if (!child || !child->digest)
+				return -ENOENT;
+			hash_str(&ctx, child->digest);
+		}
+	}
+
+	if (image->handler == &file_handler) {
+		ret = hash_file(&ctx, imageoutfile(image));
+		if (ret)
+			return ret;
+	} else {
+		get_tools_digest(digest);
+		sha256_update(&ctx, digest, sizeof(digest));
+
+		if (!image->handler->no_rootpath) {
+			ret = get_tree_digest(mountpath(image), digest);
+			if (ret)
+				return ret;
+			sha256_update(&ctx, digest, sizeof(digest));
+		}
+	}
+
+	sha256_final(&ctx, digest);
+	sha256_hex(digest, hex);
+	*key = strdup(hex);
+
+	return 0;
+}
+
+/*
+ * Only the output and its sidecars are cached. Whatever exec-pre and
+ * exec-post do besides, e.g. signing or copying the image, would be
+ * missing after a restore, so these images are always generated. The
+ * images built from them are then not cached either.
+ */
+static int cache_allowed(struct image *image)
+{
+	if (image->exec_pre || image->exec_post) {
+		image_log(image, 1, "not cached: exec-pre/exec-post set\n");
+		return 0;
+	}
+
+	return 1;
+}
+
+static int cache_entry(struct image *image, char **entry)
+{
+	return asprintf(entry, "%s/%s", cachepath(), image->digest) < 0 ?
+		-ENOMEM : 0;
+}
+
+/*
+ * copy 'src' to 'dst', using a reflink if possible
+ */
+static int cache_copy(struct image *image, const char *src, const char *dst)
+{
+	int in, out, ret;
+
+	unlink(dst);
+
+	in = open(src, O_RDONLY);
+	if (in < 0)
+		return -errno;
+	out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0) {
+		ret = -errno;
+		close(in);
+		return ret;
+	}
+	ret = ioctl(out, FICLONE, in);
+	close(out);
+	close(in);
+	if (!ret)
+		return 0;
+
+	return copy_file(image, src, dst);
+}
+
+/*
+ * files written next to the output, which are cached along with it
+ */
+static const char *sidecars[] = {
+	".bmap",
+};
+
+static int cache_copy_sidecars(struct image *image, const char *src,
+		const char *dst)
+{
+	unsigned int i;
+	int ret = 0;
+
+	for (i = 0; i < ARRAY_SIZE(sidecars) && !ret; i++) {
+		char *from, *to;
+
+		asprintf(&from, "%s%s", src, sidecars[i]);
+		asprintf(&to, "%s%s", dst, sidecars[i]);
+		if (!access(from, R_OK))
+			ret = cache_copy(image, from, to);
+		else
+			unlink(to);
+		free(from);
+		free(to);
+	}
+
+	return ret;
+}
+
+/*
+ * Compute the cache key of an image and restore its output from the
+ * cache if possible. Returns 1 if the image was restored, 0 if it has
+ * to be generated, or a negative error code.
+ */
+int cache_restore(struct image *image)
+{
+	char *entry;
+	int ret;
+
+	/* file images are hashed by content once they are copied */
+	if (!cachepath() || image->handler == &file_handler ||
+			!cache_allowed(image))
+		return 0;
+
+	ret = image_digest(image, &image->digest);
+	if (ret) {
+		image_log(image, 1, "not cached: %s\n", strerror(-ret));
+		return 0;
+	}
+
+	ret = cache_entry(image, &entry);
+	if (ret)
+		return ret;
+
+	if (access(entry, R_OK)) {
+		/* don't overwrite a previously restored cache entry in place */
+		unlink(imageoutfile(image));
+		free(entry);
+		return 0;
+	}
+
+	image_log(image, 1, "restoring from cache %s\n", entry);
+
+	ret = cache_copy_sidecars(image, entry, imageoutfile(image));
+	if (!ret)
+		ret = cache_copy(image, entry, imageoutfile(image));
+	if (ret)
+		image_error(image, "failed to restore %s from cache: %s\n",
+				entry, strerror(-ret));
+
+	free(entry);
+
+	return ret ? ret : 1;
+}
+
+/*
+ * store the output of a freshly generated image in the cache
+ */
+int cache_store(struct image *image)
+{
+	char *entry, *tmp;
+	int ret;
+
+	if (!cachepath())
+		return 0;
+
+	if (image->handler == &file_handler) {
+		if (!cache_allowed(image))
+			return 0;
+		ret = image_digest(image, &image->digest);
+		if (ret)
+			image_log(image, 1, "not cached: %s\n", strerror(-ret));
+		return 0;
+	}
+
+	if (!image->digest)
+		return 0;
+
+	ret = mkdir(cachepath(), 0755);
+	if (ret && errno != EEXIST) {
+		ret = -errno;
+		image_error(image, "failed to create %s: %s\n", cachepath(),
+				strerror(errno));
+		return ret;
+	}
+
+	ret = cache_entry(image, &entry);
+	if (ret)
+		return ret;
+
+	asprintf(&tmp, "%s.%d.tmp", entry, (int)getpid());
+
+	ret = cache_copy_sidecars(image, imageoutfile(image), entry);
+	if (!ret)
+		ret = cache_copy(image, imageoutfile(image), tmp);
+	if (!ret && rename(tmp, entry))
+		ret = -errno;
+	if (ret) {
+		image_error(image, "failed to store %s in cache: %s\n",
+				entry, strerror(-ret));
+		unlink(tmp);
+	}
+
+	free(tmp);
+	free(entry);
+
+	return ret;
+}
@@ -20,6 +20,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <getopt.h>
+#include <unistd.h>
 
 #include "genimage.h"
 
@@ -50,6 +51,24 @@ const char *get_opt(const char *name)
 	return NULL;
 }
 
+/*
+ * call 'fn' for each option. Stops when 'fn' returns nonzero.
+ */
+int for_each_opt(int (*fn)(const char *name, const char *value, void *priv),
+		void *priv)
+{
+	struct config *c;
+	int ret;
+
+	list_for_each_entry(c, &optlist, list) {
+		ret = fn(c->name, c->value, priv);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
 /*
  * set option 'name' to 'value'
  */
@@ -240,11 +259,34 @@ const char *tmppath(void)
 	return get_opt("tmppath");
 }
 
+/*
+ * number of parallel jobs, 0 meaning one per online CPU
+ */
+int get_jobs(void)
+{
+	const char *str = get_opt("jobs");
+	long jobs = 1;
+
+	if (str)
+		jobs = strtol(str, NULL, 0);
+	if (jobs == 0)
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (jobs < 1)
+		jobs = 1;
+
+	return jobs;
+}
+
 static struct config opts[] = {
 	{
 		.name = "loglevel",
 		.opt = CFG_STR("loglevel", "1", CFGF_NONE),
 		.env = "GENIMAGE_LOGLEVEL",
+	}, {
+		.name = "jobs",
+		.opt = CFG_STR("jobs", NULL, CFGF_NONE),
+		.env = "GENIMAGE_JOBS",
+		.def = "1",
 	}, {
 		.name = "rootpath",
 		.opt = CFG_STR("rootpath", NULL, CFGF_NONE),
@@ -261,6 +303,18 @@ static struct config opts[] = {
 		.name = "outputpath",
 		.opt = CFG_STR("outputpath", NULL, CFGF_NONE),
 		.env = "GENIMAGE_OUTPUTPATH",
+	}, {
+		.name = "cachepath",
+		.opt = CFG_STR("cachepath", NULL, CFGF_NONE),
+		.env = "GENIMAGE_CACHEPATH",
+	}, {
+		.name = "stats",
+		.opt = CFG_STR("stats", NULL, CFGF_NONE),
+		.env = "GENIMAGE_STATS",
+	}, {
+		.name = "trace",
+		.opt = CFG_STR("trace", NULL, CFGF_NONE),
+		.env = "GENIMAGE_TRACE",
 	}, {
 		.name = "cpio",
 		.opt = CFG_STR("cpio", NULL, CFGF_NONE),
@@ -301,6 +355,11 @@ static struct config opts[] = {
 		.opt = CFG_STR("mkdosfs", NULL, CFGF_NONE),
 		.env = "GENIMAGE_MKDOSFS",
 		.def = "mkdosfs",
+	}, {
+		.name = "mke2fs",
+		.opt = CFG_STR("mke2fs", NULL, CFGF_NONE),
+		.env = "GENIMAGE_MKE2FS",
+		.def = "mke2fs",
 	}, {
 		.name = "mkfsjffs2",
 		.opt = CFG_STR("mkfsjffs2", NULL, CFGF_NONE),
@@ -316,11 +375,21 @@ static struct config opts[] = {
 		.opt = CFG_STR("mksquashfs", NULL, CFGF_NONE),
 		.env = "GENIMAGE_MKSQUASHFS",
 		.def = "mksquashfs",
+	}, {
+		.name = "mkzftree",
+		.opt = CFG_STR("mkzftree", NULL, CFGF_NONE),
+		.env = "GENIMAGE_MKZFTREE",
+		.def = "mkzftree",
 	}, {
 		.name = "rauc",
 		.opt = CFG_STR("rauc", NULL, CFGF_NONE),
 		.env = "GENIMAGE_RAUC",
 		.def = "rauc",
+	}, {
+		.name = "sumtool",
+		.opt = CFG_STR("sumtool", NULL, CFGF_NONE),
+		.env = "GENIMAGE_SUMTOOL",
+		.def = "sumtool",
 	}, {
 		.name = "tar",
 		.opt = CFG_STR("tar", NULL, CFGF_NONE),
@@ -336,6 +405,11 @@ static struct config opts[] = {
 		.opt = CFG_STR("ubinize", NULL, CFGF_NONE),
 		.env = "GENIMAGE_UBINIZE",
 		.def = "ubinize",
+	}, {
+		.name = "xorriso",
+		.opt = CFG_STR("xorriso", NULL, CFGF_NONE),
+		.env = "GENIMAGE_XORRISO",
+		.def = "xorriso",
 	}, {
 		.name = "rsync",
 		.opt = CFG_STR("rsync", NULL, CFGF_NONE),
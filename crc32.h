@@ -0,0 +1,9 @@
+#ifndef __CRC32_H
+#define __CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint32_t crc32(uint32_t crc, const void *data, size_t len);
+
+#endif /* __CRC32_H */
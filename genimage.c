@@ -22,6 +22,8 @@
 #include <libgen.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 #include "genimage.h"
 
@@ -112,6 +114,7 @@ static cfg_opt_t flashchip_opts[] = {
 	CFG_STR("minimum-io-unit-size", "", CFGF_NONE),
 	CFG_STR("vid-header-offset", "", CFGF_NONE),
 	CFG_STR("sub-page-size", "", CFGF_NONE),
+	CFG_STR("oob-size", "", CFGF_NONE),
 	CFG_END()
 };
 
@@ -131,6 +134,80 @@ struct image *image_get(const char *filename)
 	return NULL;
 }
 
+static int overwriteenv(const char *name, const char *value)
+{
+	int ret;
+
+	ret = setenv(name, value ? : "", 1);
+	if (ret)
+		return -errno;
+
+	return 0;
+}
+
+static int setenv_paths(void)
+{
+	int ret;
+
+	ret = overwriteenv("OUTPUTPATH", imagepath());
+	if (ret)
+		return ret;
+
+	ret = overwriteenv("INPUTPATH", inputpath());
+	if (ret)
+		return ret;
+
+	ret = overwriteenv("ROOTPATH", rootpath());
+	if (ret)
+		return ret;
+
+	ret = overwriteenv("TMPPATH", tmppath());
+	if (ret)
+		return ret;
+
+	return 0;
+}
+
+static const char *image_env_vars[] = {
+	"IMAGE", "IMAGEOUTFILE", "IMAGENAME", "IMAGESIZE", "IMAGEMOUNTPOINT",
+};
+
+/*
+ * The environment of exec-pre/exec-post commands: that of genimage with
+ * the IMAGE* variables of 'image'. The process environment is not
+ * modified, other threads may be reading it.
+ */
+static char **image_envp(const struct image *image)
+{
+	char **envp;
+	unsigned int j;
+	int i, n = 0;
+
+	for (i = 0; environ[i]; i++)
+		;
+	envp = xzalloc((i + ARRAY_SIZE(image_env_vars) + 1) * sizeof(*envp));
+
+	for (i = 0; environ[i]; i++) {
+		for (j = 0; j < ARRAY_SIZE(image_env_vars); j++) {
+			size_t len = strlen(image_env_vars[j]);
+
+			if (!strncmp(environ[i], image_env_vars[j], len) &&
+					environ[i][len] == '=')
+				break;
+		}
+		if (j == ARRAY_SIZE(image_env_vars))
+			envp[n++] = strdup(environ[i]);
+	}
+
+	asprintf(&envp[n++], "IMAGE=%s", image->file);
+	asprintf(&envp[n++], "IMAGEOUTFILE=%s", imageoutfile(image));
+	asprintf(&envp[n++], "IMAGENAME=%s", image->name ? : "");
+	asprintf(&envp[n++], "IMAGESIZE=%llu", image->size);
+	asprintf(&envp[n++], "IMAGEMOUNTPOINT=%s", image->mountpoint ? : "");
+
+	return envp;
+}
+
 /*
  * setup the images. Calls ->setup function for each
  * image, recursively calls itself for resolving dependencies
@@ -165,8 +242,13 @@ static int image_setup(struct image *image)
 			return ret;
 		}
 	}
-	if (image->handler->setup)
+	if (image->handler->setup) {
+		struct stats_span span;
+
+		stats_start(&span);
 		ret = image->handler->setup(image, image->imagesec);
+		stats_stop(image, "setup", &span);
+	}
 
 	if (ret)
 		return ret;
@@ -176,6 +258,89 @@ static int image_setup(struct image *image)
 	return 0;
 }
 
+/*
+ * run a custom exec-pre/exec-post command
+ */
+static int image_exec(struct image *image, const char *cmd)
+{
+	struct argv args = {};
+	char **envp = image_envp(image);
+	int i, ret;
+
+	argv_add(&args, "/bin/sh");
+	argv_add(&args, "-c");
+	argv_add(&args, "%s", cmd);
+	args.envp = envp;
+
+	ret = run_argv(image, &args);
+
+	for (i = 0; envp[i]; i++)
+		free(envp[i]);
+	free(envp);
+
+	return ret;
+}
+
+/*
+ * generate a single image. All images it depends on
+ * must already be generated.
+ */
+static int image_generate_one(struct image *image)
+{
+	struct stats_span span;
+	int ret;
+
+	stats_start(&span);
+	ret = cache_restore(image);
+	stats_stop(image, ret > 0 ? "cache-restore" : "cache-lookup", &span);
+	if (ret < 0)
+		return ret;
+	if (ret > 0) {
+		image->done = 1;
+		return 0;
+	}
+
+	if (image->exec_pre) {
+		stats_start(&span);
+		ret = image_exec(image, image->exec_pre);
+		stats_stop(image, "exec-pre", &span);
+		if (ret)
+			return ret;
+	}
+
+	if (image->handler->generate) {
+		stats_start(&span);
+		ret = image->handler->generate(image);
+		stats_stop(image, "generate", &span);
+	} else {
+		image_error(image, "no generate function for %s\n", image->file);
+		return -EINVAL;
+	}
+
+	if (ret) {
+		unlink(imageoutfile(image));
+		return ret;
+	}
+
+	if (image->exec_post) {
+		stats_start(&span);
+		ret = image_exec(image, image->exec_post);
+		stats_stop(image, "exec-post", &span);
+		if (ret)
+			return ret;
+	}
+
+	stats_start(&span);
+	ret = cache_store(image);
+	stats_stop(image, "cache-store", &span);
+	if (ret)
+		return ret;
+
+	image->done = 1;
+
+	return 0;
+}
+
 /*
  * generate the images. Calls ->generate function for each
  * image, recursively calls itself for resolving dependencies
@@ -211,35 +376,153 @@ static int image_generate(struct image *image)
 		}
 	}
 
-	if (image->exec_pre) {
-		ret = systemp(image, "%s", image->exec_pre);
-		if (ret)
-			return ret;
-	}
+	return image_generate_one(image);
+}
 
-	if (image->handler->generate) {
-		ret = image->handler->generate(image);
-	} else {
-		image_error(image, "no generate function for %s\n", image->file);
-		return -EINVAL;
+/*
+ * Parallel generation: each image is a node in a dependency graph with
+ * an edge to every image referenced by its partitions. An image whose
+ * dependencies are all generated is put on the ready list, from where
+ * it is picked up by one of the worker threads.
+ */
+static LIST_HEAD(ready_images);
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_cond = PTHREAD_COND_INITIALIZER;
+static int sched_running;
+static int sched_remaining;
+static int sched_error;
+
+static void image_add_user(struct image *image, struct image *user)
+{
+	int i;
+
+	for (i = 0; i < image->num_users; i++) {
+		if (image->users[i] == user)
+			return;
 	}
 
-	if (ret) {
-		systemp(image, "rm -f %s", imageoutfile(image));
-		return ret;
+	image->users = realloc(image->users,
+			(image->num_users + 1) * sizeof(*image->users));
+	if (!image->users) {
+		error("out of memory\n");
+		exit(1);
 	}
+	image->users[image->num_users++] = user;
+	user->pending++;
+}
 
-	if (image->exec_post) {
-		ret = systemp(image, "%s", image->exec_post);
-		if (ret)
-			return ret;
+static int image_build_graph(void)
+{
+	struct image *image;
+	struct partition *part;
+
+	list_for_each_entry(image, &images, list) {
+		list_for_each_entry(part, &image->partitions, list) {
+			struct image *child;
+
+			if (!part->image)
+				continue;
+			child = image_get(part->image);
+			if (!child) {
+				image_error(image, "could not find %s\n", part->image);
+				return -EINVAL;
+			}
+			image_add_user(child, image);
+		}
+		sched_remaining++;
 	}
 
-	image->done = 1;
+	list_for_each_entry(image, &images, list) {
+		if (!image->pending)
+			list_add_tail(&image->queue, &ready_images);
+	}
 
 	return 0;
 }
 
+static void *image_worker(void *unused)
+{
+	struct image *image;
+	int i, ret;
+
+	pthread_mutex_lock(&sched_lock);
+
+	while (sched_remaining && !sched_error) {
+		if (list_empty(&ready_images)) {
+			if (!sched_running) {
+				error("recursive dependency detected\n");
+				sched_error = -EINVAL;
+				break;
+			}
+			pthread_cond_wait(&sched_cond, &sched_lock);
+			continue;
+		}
+
+		image = list_first_entry(&ready_images, struct image, queue);
+		list_del(&image->queue);
+		sched_running++;
+
+		pthread_mutex_unlock(&sched_lock);
+		ret = image_generate_one(image);
+		pthread_mutex_lock(&sched_lock);
+
+		sched_running--;
+		sched_remaining--;
+
+		if (ret) {
+			image_error(image, "failed to generate %s\n", image->file);
+			sched_error = ret;
+		} else {
+			for (i = 0; i < image->num_users; i++) {
+				struct image *user = image->users[i];
+
+				if (!--user->pending)
+					list_add_tail(&user->queue, &ready_images);
+			}
+		}
+
+		pthread_cond_broadcast(&sched_cond);
+	}
+
+	pthread_cond_broadcast(&sched_cond);
+	pthread_mutex_unlock(&sched_lock);
+
+	return NULL;
+}
+
+static int image_generate_parallel(int jobs)
+{
+	pthread_t *threads;
+	int i, ret;
+
+	ret = image_build_graph();
+	if (ret)
+		return ret;
+
+	logmsg(1, "generating images using %d jobs\n", jobs);
+
+	threads = xzalloc(jobs * sizeof(*threads));
+
+	for (i = 0; i < jobs; i++) {
+		ret = pthread_create(&threads[i], NULL, image_worker, NULL);
+		if (ret) {
+			error("failed to create thread: %s\n", strerror(ret));
+			pthread_mutex_lock(&sched_lock);
+			sched_error = -ret;
+			pthread_cond_broadcast(&sched_cond);
+			pthread_mutex_unlock(&sched_lock);
+			break;
+		}
+	}
+
+	while (i--)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+
+	return sched_error;
+}
+
 static LIST_HEAD(flashlist);
 
 static int parse_flashes(cfg_t *cfg)
@@ -260,6 +543,7 @@ static int parse_flashes(cfg_t *cfg)
 		flash->minimum_io_unit_size = cfg_getint_suffix(flashsec, "minimum-io-unit-size");
 		flash->vid_header_offset = cfg_getint_suffix(flashsec, "vid-header-offset");
 		flash->sub_page_size = cfg_getint_suffix(flashsec, "sub-page-size");
+		flash->oob_size = cfg_getint_suffix(flashsec, "oob-size");
 		list_add_tail(&flash->list, &flashlist);
 	}
 
@@ -380,11 +664,11 @@ static int collect_mountpoints(void)
 
 	add_root_mountpoint();
 
-	ret = systemp(NULL, "mkdir -p %s", tmppath());
+	ret = mkdir_p(tmppath(), 0777);
 	if (ret)
 		return ret;
 
-	ret = systemp(NULL, "cp -a %s %s/root", rootpath(), tmppath());
+	ret = copy_tree(rootpath(), get_mountpoint("")->mountpath, 0);
 	if (ret)
 		return ret;
 
@@ -393,19 +677,29 @@ static int collect_mountpoints(void)
 			image->mp = add_mountpoint(image->mountpoint);
 	}
 
+	/*
+	 * Move the mountpoints out of the root tree, leaving an empty
+	 * directory with the same permissions in its place.
+	 */
 	list_for_each_entry(mp, &mountpoints, list) {
+		char *path, *dir;
+		struct stat s;
+
 		if (!strlen(mp->path))
 			continue;
-		ret = systemp(NULL, "mv %s/root/%s %s", tmppath(), mp->path, tmppath());
-		if (ret)
-			return ret;
-		ret = systemp(NULL, "mkdir %s/root/%s", tmppath(), mp->path);
-		if (ret)
-			return ret;
-		ret = systemp(NULL, "chmod --reference=%s %s/root/%s", mp->mountpath, tmppath(), mp->path);
-		if (ret)
-			return ret;
-		ret = systemp(NULL, "chown --reference=%s %s/root/%s", mp->mountpath, tmppath(), mp->path);
+
+		asprintf(&path, "%s/root/%s", tmppath(), mp->path);
+		dir = strdupa(mp->mountpath);
+		ret = mkdir_p(dirname(dir), 0777);
+		if (!ret && (lstat(path, &s) || rename(path, mp->mountpath) ||
+				mkdir(path, s.st_mode & 07777) ||
+				chmod(path, s.st_mode & 07777) ||
+				(lchown(path, s.st_uid, s.st_gid) && errno != EPERM))) {
+			ret = -errno;
+			error("cannot move mountpoint %s to %s: %s\n", path,
+					mp->mountpath, strerror(errno));
+		}
+		free(path);
 		if (ret)
 			return ret;
 	}
@@ -440,10 +734,9 @@ static void check_tmp_path(void)
 
 	dir = opendir(tmp);
 	if (!dir) {
-		ret = systemp(NULL, "mkdir -p %s", tmppath());
+		ret = mkdir_p(tmppath(), 0777);
 		if (ret)
 			exit(1);
-		closedir(dir);
 		return;
 	}
 
@@ -463,7 +756,6 @@ static void check_tmp_path(void)
 static int check_image_path(void)
 {
 	const char *path = imagepath();
-	int ret;
 	DIR *dir;
 
 	if (!path) {
@@ -477,18 +769,13 @@ static int check_image_path(void)
 		return 0;
 	}
 
-	ret = systemp(NULL, "mkdir -p %s", imagepath());
-	if (ret)
-		ret=-ret;
-
-	closedir(dir);
-	return ret;
+	return mkdir_p(imagepath(), 0777);
 }
 
 static void cleanup(void)
 {
 	if (tmppath_generated)
-		systemp(NULL, "rm -rf %s/*", tmppath());
+		remove_tree_contents(tmppath());
 }
 
 static cfg_opt_t top_opts[] = {
@@ -499,74 +786,12 @@ static cfg_opt_t top_opts[] = {
 	CFG_END()
 };
 
-static int overwriteenv(const char *name, const char *value)
-{
-	int ret;
-
-	ret = setenv(name, value ? : "", 1);
-	if (ret)
-		return -errno;
-
-	return 0;
-}
-
-static int setenv_paths(void)
-{
-	int ret;
-
-	ret = overwriteenv("OUTPUTPATH", imagepath());
-	if (ret)
-		return ret;
-
-	ret = overwriteenv("INPUTPATH", inputpath());
-	if (ret)
-		return ret;
-
-	ret = overwriteenv("ROOTPATH", rootpath());
-	if (ret)
-		return ret;
-
-	ret = overwriteenv("TMPPATH", tmppath());
-	if (ret)
-		return ret;
-
-	return 0;
-}
-
-static int setenv_image(const struct image *image)
-{
-	int ret;
-	char sizestr[20];
-
-	snprintf(sizestr, sizeof(sizestr), "%llu", image->size);
-
-	ret = overwriteenv("IMAGE", image->file);
-	if (ret)
-		return ret;
-
-	ret = overwriteenv("IMAGEOUTFILE", imageoutfile(image));
-	if (ret)
-		return ret;
-
-	ret = overwriteenv("IMAGENAME", image->name);
-	if (ret)
-		return ret;
-
-	ret = overwriteenv("IMAGESIZE", sizestr);
-	if (ret)
-		return ret;
-
-	ret = overwriteenv("IMAGEMOUNTPOINT", image->mountpoint);
-	if (ret)
-		return ret;
-
-	return 0;
-}
-
 int main(int argc, char *argv[])
 {
 	unsigned int i;
 	unsigned int num_images;
+	struct stats_span span;
+	int jobs;
 	int ret;
 	cfg_opt_t *imageopts = xzalloc((ARRAY_SIZE(image_common_opts) +
 				ARRAY_SIZE(handlers) + 1) * sizeof(cfg_opt_t));;
@@ -624,7 +849,7 @@ int main(int argc, char *argv[])
 
 	check_tmp_path();
 
-	ret = systemp(NULL, "rm -rf %s/*", tmppath());
+	ret = remove_tree_contents(tmppath());
 	if (ret)
 		goto cleanup;
 
@@ -702,15 +927,19 @@ int main(int argc, char *argv[])
 	if (ret)
 		goto cleanup;
 
+	stats_start(&span);
 	ret = collect_mountpoints();
+	stats_stop(NULL, "stage-root", &span);
 	if (ret)
 		goto cleanup;
 
-	list_for_each_entry(image, &images, list) {
-		ret = setenv_image(image);
-		if (ret)
-			goto cleanup;
+	jobs = get_jobs();
+	if (jobs > 1) {
+		ret = image_generate_parallel(jobs);
+		goto cleanup;
+	}
 
+	list_for_each_entry(image, &images, list) {
 		ret = image_generate(image);
 		if (ret) {
 			image_error(image, "failed to generate %s\n", image->file);
@@ -719,6 +948,7 @@ int main(int argc, char *argv[])
 	}
 
 cleanup:
+	stats_write();
 	cleanup();
 	return ret ? 1 : 0;
 }
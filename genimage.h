@@ -2,6 +2,9 @@
 #define __PTX_IMAGE_H
 
 #include <sys/types.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <time.h>
 #include <unistd.h>
 #include "list.h"
 
@@ -21,6 +24,19 @@ int popenbd(const char *cmdline, struct bdpipe *pipe);
 FILE *popenp(struct image *image, const char *mode, const char *fmt, ...);
 struct bdpipe *popenbdp(struct image *image, const char *mode, const char *fmt, ...);
 int systemp(struct image *image, const char *fmt, ...) __attribute__ ((format(printf, 2, 3)));
+
+struct argv {
+	char **argv;
+	int argc;
+	int ok_status;	/* highest exit status which is not a failure */
+	char **envp;	/* environment of the command, default environ */
+};
+
+void argv_add(struct argv *args, const char *fmt, ...) __attribute__ ((format(printf, 2, 3)));
+int argv_add_split(struct argv *args, const char *str);
+int argv_add_opt(struct image *image, struct argv *args, const char *opt);
+void argv_free(struct argv *args);
+int run_argv(struct image *image, struct argv *args);
 void error(const char *fmt, ...) __attribute__ ((format(printf, 1, 2)));
 void logmsg(int level, const char *fmt, ...) __attribute__ ((format(printf, 2, 3)));
 void image_error(struct image *image, const char *fmt, ...) __attribute__ ((format(printf, 2, 3)));
@@ -31,6 +47,7 @@ const char *inputpath(void);
 const char *rootpath(void);
 const char *tmppath(void);
 const char *mountpath(struct image *);
+int get_jobs(void);
 struct flash_type;
 
 struct mountpoint {
@@ -71,6 +88,11 @@ struct image {
 	struct mountpoint *mp;
 	char *outfile;
 	int seen;
+	struct image **users;
+	int num_users;
+	int pending;
+	struct list_head queue;
+	char *digest;
 };
 
 struct image_handler {
@@ -79,6 +101,7 @@ struct image_handler {
 	int (*setup)(struct image *i, cfg_t *cfg);
 	int (*generate)(struct image *i);
 	cfg_opt_t *opts;
+	cfg_bool_t no_rootpath;
 };
 
 struct flash_type {
@@ -89,6 +112,7 @@ struct flash_type {
 	int minimum_io_unit_size;
 	int vid_header_offset;
 	int sub_page_size;
+	int oob_size;
 	struct list_head list;
 };
 
@@ -132,6 +156,61 @@ int init_config(void);
 cfg_opt_t *get_confuse_opts(void);
 const char *get_opt(const char *name);
 int set_config_opts(int argc, char *argv[], cfg_t *cfg);
+int for_each_opt(int (*fn)(const char *name, const char *value, void *priv),
+		void *priv);
+
+struct bmap;
+struct bmap *bmap_new(void);
+void bmap_free(struct bmap *bmap);
+void bmap_add_range(struct bmap *bmap, unsigned long long start,
+		unsigned long long end);
+int bmap_add_file(struct bmap *bmap, const char *file, unsigned long long offset);
+int bmap_write(struct image *image, struct bmap *bmap);
+
+struct vdisk;
+struct vdisk *vdisk_new(unsigned long long size);
+void vdisk_free(struct vdisk *vd);
+void vdisk_add_data(struct vdisk *vd, const void *data, size_t size,
+		unsigned long long offset);
+int vdisk_add_file(struct vdisk *vd, const char *file, unsigned long long size,
+		unsigned long long offset);
+int vdisk_write_android_sparse(struct image *image, struct vdisk *vd);
+int vdisk_write_qcow2(struct image *image, struct vdisk *vd);
+
+struct nand_ecc;
+struct nand_ecc *nand_ecc_new(const char *algo, int step, int strength);
+void nand_ecc_free(struct nand_ecc *ecc);
+int nand_ecc_bytes(const struct nand_ecc *ecc);
+int nand_ecc_step(const struct nand_ecc *ecc);
+void nand_ecc_calculate(const struct nand_ecc *ecc, const unsigned char *buf,
+		unsigned char *code);
+
+struct stats_span {
+	struct timespec start;
+	struct rusage ru;
+};
+
+void stats_start(struct stats_span *span);
+void stats_stop(struct image *image, const char *name, struct stats_span *span);
+void stats_tool(struct image *image, const char *name, struct stats_span *span,
+		const struct rusage *ru);
+int stats_write(void);
+
+struct filter {
+	struct argv args;
+	pid_t pid;
+	int fd;		/* input of the filter */
+	sigset_t sigmask;
+	struct stats_span span;
+};
+
+int filter_open(struct image *image, struct filter *filter, struct argv *args,
+		const char *outfile);
+int filter_close(struct image *image, struct filter *filter);
+
+int cache_restore(struct image *image);
+int cache_store(struct image *image);
+int cache_tree_digest(const char *path, char *hex);
 
 enum pad_mode {
 	MODE_APPEND,
@@ -142,6 +221,19 @@ int pad_file(struct image *image, const char *infile, const char *outfile,
 		size_t size, unsigned char fillpattern, enum pad_mode mode);
 int insert_data(struct image *image, const char *data, const char *outfile,
 		size_t size, long offset);
+int insert_image(struct image *image, int fd, const char *infile,
+		size_t size, off_t offset, unsigned char fillpattern);
+int insert_fill(int fd, off_t offset, size_t size, unsigned char fillpattern);
+int copy_data(int in, off_t inoff, int out, off_t outoff, size_t size);
+int extend_fd(int fd, off_t size);
+int copy_file(struct image *image, const char *src, const char *dst);
+int run_parallel(int num, int (*fn)(void *priv, int i), void *priv);
+
+int mkdir_p(const char *path, mode_t mode);
+int remove_tree_contents(const char *path);
+int copy_tree(const char *src, const char *dst, int link);
+int link_file(struct image *image, const char *src, const char *dst);
+int dedup_tree(struct image *image, const char *path);
 
 unsigned long long cfg_getint_suffix(cfg_t *sec, const char *name);
 
@@ -19,15 +19,429 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <search.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 
 #include "genimage.h"
 
+/*
+ * Native writer for the newc and crc formats, as used for initramfs. The
+ * tree is walked in sorted order and inode numbers are assigned in that
+ * order, so that the archive only depends on the contents of the tree.
+ * Like GNU cpio, the data of a file with several links is stored with
+ * its last link in the archive.
+ */
+
+struct cpio_entry {
+	char *name;	/* "." or "./path" */
+	char *path;	/* in the filesystem */
+	struct stat s;
+	unsigned int ino;
+	struct cpio_inode *inode;	/* for files with several links */
+};
+
+struct cpio_inode {
+	dev_t dev;
+	ino_t ino;
+	unsigned int num;
+	unsigned int links;	/* in the archive */
+	struct cpio_entry *last;
+};
+
+struct cpio {
+	struct image *image;
+	struct cpio_entry *entries;
+	int num_entries;
+	void *inodes;
+	unsigned int next_ino;
+	int crc;
+	long long mtime;	/* -1 to keep the mtime of the files */
+	int fd;
+	unsigned long long offset;
+	char buf[65536];
+	size_t len;
+};
+
+static int cpio_inode_cmp(const void *a, const void *b)
+{
+	const struct cpio_inode *ia = a, *ib = b;
+
+	if (ia->dev != ib->dev)
+		return ia->dev < ib->dev ? -1 : 1;
+	if (ia->ino != ib->ino)
+		return ia->ino < ib->ino ? -1 : 1;
+	return 0;
+}
+
+static int cpio_name_cmp(const struct dirent **a, const struct dirent **b)
+{
+	return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+static int cpio_skip_dots(const struct dirent *d)
+{
+	return strcmp(d->d_name, ".") && strcmp(d->d_name, "..");
+}
+
+static int cpio_collect(struct cpio *cpio, const char *path, const char *name)
+{
+	struct cpio_entry *e;
+	struct dirent **list;
+	struct stat s;
+	int i, n, ret = 0;
+
+	if (lstat(path, &s)) {
+		ret = -errno;
+		image_error(cpio->image, "stat %s: %s\n", path, strerror(errno));
+		return ret;
+	}
+
+	if (!(cpio->num_entries % 1024))
+		cpio->entries = realloc(cpio->entries,
+				(cpio->num_entries + 1024) * sizeof(*e));
+	if (!cpio->entries)
+		return -ENOMEM;
+	e = &cpio->entries[cpio->num_entries++];
+	e->name = strdup(name);
+	e->path = strdup(path);
+	e->s = s;
+	e->inode = NULL;
+
+	if (S_ISREG(s.st_mode) && s.st_nlink > 1) {
+		struct cpio_inode key = { .dev = s.st_dev, .ino = s.st_ino };
+		struct cpio_inode **found, *inode;
+
+		found = tfind(&key, &cpio->inodes, cpio_inode_cmp);
+		if (found) {
+			inode = *found;
+		} else {
+			inode = xzalloc(sizeof(*inode));
+			*inode = key;
+			inode->num = cpio->next_ino++;
+			tsearch(inode, &cpio->inodes, cpio_inode_cmp);
+		}
+		inode->links++;
+		e->ino = inode->num;
+		e->inode = inode;
+	} else {
+		e->ino = cpio->next_ino++;
+	}
+
+	if (!S_ISDIR(s.st_mode))
+		return 0;
+
+	n = scandir(path, &list, cpio_skip_dots, cpio_name_cmp);
+	if (n < 0) {
+		ret = -errno;
+		image_error(cpio->image, "scandir %s: %s\n", path, strerror(errno));
+		return ret;
+	}
+
+	for (i = 0; i < n; i++) {
+		char *cpath, *cname;
+
+		if (!ret) {
+			asprintf(&cpath, "%s/%s", path, list[i]->d_name);
+			asprintf(&cname, "%s/%s", name, list[i]->d_name);
+			ret = cpio_collect(cpio, cpath, cname);
+			free(cpath);
+			free(cname);
+		}
+		free(list[i]);
+	}
+	free(list);
+
+	return ret;
+}
+
+static int cpio_flush(struct cpio *cpio)
+{
+	size_t done = 0;
+
+	while (done < cpio->len) {
+		ssize_t w = write(cpio->fd, cpio->buf + done, cpio->len - done);
+
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w < 0) {
+			int ret = -errno;
+
+			image_error(cpio->image, "write: %s\n", strerror(errno));
+			return ret;
+		}
+		done += w;
+	}
+	cpio->len = 0;
+
+	return 0;
+}
+
+static int cpio_write(struct cpio *cpio, const void *data, size_t size)
+{
+	while (size) {
+		size_t now = sizeof(cpio->buf) - cpio->len;
+		int ret;
+
+		if (now > size)
+			now = size;
+		memcpy(cpio->buf + cpio->len, data, now);
+		cpio->len += now;
+		cpio->offset += now;
+		data = (const char *)data + now;
+		size -= now;
+
+		if (cpio->len == sizeof(cpio->buf)) {
+			ret = cpio_flush(cpio);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
+static int cpio_pad(struct cpio *cpio, unsigned int align)
+{
+	static const char zero[512];
+
+	return cpio_write(cpio, zero, (align - cpio->offset % align) % align);
+}
+
+static int cpio_header(struct cpio *cpio, const char *name, unsigned int ino,
+		unsigned int mode, unsigned int uid, unsigned int gid,
+		unsigned int nlink, unsigned int mtime, unsigned int size,
+		dev_t rdev, unsigned int check)
+{
+	char hdr[111];
+	int ret;
+
+	snprintf(hdr, sizeof(hdr), "%s%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X",
+			cpio->crc ? "070702" : "070701", ino, mode, uid, gid,
+			nlink, mtime, size, 0, 0, major(rdev), minor(rdev),
+			(unsigned int)strlen(name) + 1, check);
+
+	ret = cpio_write(cpio, hdr, 110);
+	if (!ret)
+		ret = cpio_write(cpio, name, strlen(name) + 1);
+	if (!ret)
+		ret = cpio_pad(cpio, 4);
+
+	return ret;
+}
+
+/*
+ * Copy 'size' bytes of 'fd' to the archive or, with 'sum' set, only add
+ * them up for the crc format
+ */
+static int cpio_file_data(struct cpio *cpio, struct cpio_entry *e, int fd,
+		unsigned int *sum)
+{
+	unsigned long long left = e->s.st_size;
+	unsigned char buf[65536];
+	int ret;
+
+	while (left) {
+		ssize_t r = pread(fd, buf, left < sizeof(buf) ? left : sizeof(buf),
+				e->s.st_size - left);
+
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			ret = r ? -errno : -EIO;
+			image_error(cpio->image, "read %s: %s\n", e->path,
+					r ? strerror(errno) : "file shrunk");
+			return ret;
+		}
+		if (sum) {
+			ssize_t i;
+
+			for (i = 0; i < r; i++)
+				*sum += buf[i];
+		} else {
+			ret = cpio_write(cpio, buf, r);
+			if (ret)
+				return ret;
+		}
+		left -= r;
+	}
+
+	return 0;
+}
+
+static int cpio_entry(struct cpio *cpio, struct cpio_entry *e)
+{
+	unsigned int nlink, mtime, size = 0, sum = 0;
+	char *target = NULL;
+	int fd = -1, ret;
+
+	if (e->inode)
+		nlink = e->inode->links;
+	else
+		nlink = S_ISDIR(e->s.st_mode) ? e->s.st_nlink : 1;
+	mtime = cpio->mtime >= 0 ? cpio->mtime : e->s.st_mtime;
+
+	if (S_ISREG(e->s.st_mode) && (!e->inode || e->inode->last == e)) {
+		if (e->s.st_size > 0xffffffffLL) {
+			image_error(cpio->image, "%s: too large for cpio\n", e->path);
+			return -EFBIG;
+		}
+		size = e->s.st_size;
+		fd = open(e->path, O_RDONLY);
+		if (fd < 0) {
+			ret = -errno;
+			image_error(cpio->image, "open %s: %s\n", e->path,
+					strerror(errno));
+			return ret;
+		}
+		if (cpio->crc) {
+			ret = cpio_file_data(cpio, e, fd, &sum);
+			if (ret)
+				goto out;
+		}
+	} else if (S_ISLNK(e->s.st_mode)) {
+		ssize_t len;
+
+		target = xzalloc(e->s.st_size + 1);
+		len = readlink(e->path, target, e->s.st_size + 1);
+		if (len < 0 || len > e->s.st_size) {
+			ret = len < 0 ? -errno : -EIO;
+			image_error(cpio->image, "readlink %s: %s\n", e->path,
+					strerror(-ret));
+			goto out;
+		}
+		size = len;
+		for (len = 0; len < size; len++)
+			sum += (unsigned char)target[len];
+	}
+
+	ret = cpio_header(cpio, e->name, e->ino, e->s.st_mode, e->s.st_uid,
+			e->s.st_gid, nlink, mtime, size, e->s.st_rdev, sum);
+	if (ret)
+		goto out;
+
+	if (fd >= 0)
+		ret = cpio_file_data(cpio, e, fd, NULL);
+	else if (target)
+		ret = cpio_write(cpio, target, size);
+	if (!ret)
+		ret = cpio_pad(cpio, 4);
+out:
+	if (fd >= 0)
+		close(fd);
+	free(target);
+
+	return ret;
+}
+
+static int cpio_write_archive(struct cpio *cpio)
+{
+	int i, ret;
+
+	for (i = 0; i < cpio->num_entries; i++)
+		if (cpio->entries[i].inode)
+			cpio->entries[i].inode->last = &cpio->entries[i];
+
+	for (i = 0; i < cpio->num_entries; i++) {
+		ret = cpio_entry(cpio, &cpio->entries[i]);
+		if (ret)
+			return ret;
+	}
+
+	ret = cpio_header(cpio, "TRAILER!!!", 0, 0, 0, 0, 1, 0, 0, 0, 0);
+	/* in 512 byte blocks, like GNU cpio */
+	if (!ret)
+		ret = cpio_pad(cpio, 512);
+	if (!ret)
+		ret = cpio_flush(cpio);
+
+	return ret;
+}
+
+static int cpio_generate_native(struct image *image, const char *format,
+		const char *comp, const char *mtime)
+{
+	struct filter filter;
+	struct cpio *cpio;
+	int i, ret;
+
+	cpio = xzalloc(sizeof(*cpio));
+	cpio->image = image;
+	cpio->crc = !strcmp(format, "crc");
+	cpio->mtime = *mtime ? strtoll(mtime, NULL, 0) : -1;
+	cpio->next_ino = 1;
+	cpio->fd = -1;
+
+	ret = cpio_collect(cpio, mountpath(image), ".");
+	if (ret)
+		goto out;
+
+	if (*comp) {
+		struct argv args = {};
+
+		/* pipelines and the like need a shell */
+		if (strpbrk(comp, "\n|&;<>(){}")) {
+			argv_add(&args, "/bin/sh");
+			argv_add(&args, "-c");
+			argv_add(&args, "%s", comp);
+		} else {
+			ret = argv_add_split(&args, comp);
+		}
+		if (!ret)
+			ret = filter_open(image, &filter, &args, imageoutfile(image));
+		argv_free(&args);
+		if (ret)
+			goto out;
+		cpio->fd = filter.fd;
+	} else {
+		cpio->fd = open(imageoutfile(image),
+				O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+		if (cpio->fd < 0) {
+			ret = -errno;
+			image_error(image, "open %s: %s\n", imageoutfile(image),
+					strerror(errno));
+			goto out;
+		}
+	}
+
+	ret = cpio_write_archive(cpio);
+
+	if (*comp) {
+		int status = filter_close(image, &filter);
+
+		if (!ret)
+			ret = status;
+	} else if (close(cpio->fd) && !ret) {
+		ret = -errno;
+	}
+out:
+	for (i = 0; i < cpio->num_entries; i++) {
+		free(cpio->entries[i].name);
+		free(cpio->entries[i].path);
+	}
+	free(cpio->entries);
+	tdestroy(cpio->inodes, free);
+	free(cpio);
+
+	return ret;
+}
+
 static int cpio_generate(struct image *image)
 {
 	int ret;
 	char *format = cfg_getstr(image->imagesec, "format");
 	char *extraargs = cfg_getstr(image->imagesec, "extraargs");
 	char *comp = cfg_getstr(image->imagesec, "compress");
+	char *mtime = cfg_getstr(image->imagesec, "mtime");
+
+	if ((!strcmp(format, "newc") || !strcmp(format, "crc")) && !*extraargs)
+		return cpio_generate_native(image, format, comp, mtime);
+
+	if (*mtime)
+		image_log(image, 1, "mtime is only supported for the newc and crc formats without extraargs\n");
 
 	ret = systemp(image, "(cd \"%s\" && find . | %s -H \"%s\" %s -o %s %s) > %s",
 			mountpath(image),
@@ -42,6 +456,7 @@ static cfg_opt_t cpio_opts[] = {
 	CFG_STR("format", "newc", CFGF_NONE),
 	CFG_STR("extraargs", "", CFGF_NONE),
 	CFG_STR("compress", "", CFGF_NONE),
+	CFG_STR("mtime", "", CFGF_NONE),
 	CFG_END()
 };
 
@@ -22,6 +22,8 @@
 #include <unistd.h>
 #include <ftw.h>
 #include <stdbool.h>
+#include <libgen.h>
+#include <sys/stat.h>
 
 /* POSIX.1 says each process has at least 20 file descriptors.
  * Three of those belong to the standard streams.
@@ -43,46 +45,118 @@
 
 #define DEBUGFS_PROMPT "debugfs: "
 
-static int ext2_generate(struct image *image)
+/*
+ * Create and populate the filesystem in one pass with 'mke2fs -d'. The
+ * features and the label are set at creation time, so there is no need
+ * for tune2fs and e2fsck passes over the image afterwards.
+ */
+static int ext2_generate_mke2fs(struct image *image, const char *root)
 {
-	int ret;
-    struct partition *part;
-	char *extraargs = cfg_getstr(image->imagesec, "extraargs");
+	struct argv args = {};
 	char *features = cfg_getstr(image->imagesec, "features");
 	char *label = cfg_getstr(image->imagesec, "label");
+	int ret;
+
+	ret = pad_file(image, NULL, imageoutfile(image), image->size, 0x0,
+			MODE_OVERWRITE);
+	if (ret)
+		return ret;
+
+	argv_add_split(&args, get_opt("mke2fs"));
+	argv_add(&args, "-t");
+	argv_add(&args, "%s", image->handler->type);
+	argv_add(&args, "-d");
+	argv_add(&args, "%s", root);
+	argv_add(&args, "-i");
+	argv_add(&args, "16384");
+	if (features && features[0] != '\0') {
+		argv_add(&args, "-O");
+		argv_add(&args, "%s", features);
+	}
+	if (label && label[0] != '\0') {
+		argv_add(&args, "-L");
+		argv_add(&args, "%s", label);
+	}
+	argv_add(&args, "-F");
+	argv_add(&args, "-q");
+	ret = argv_add_opt(image, &args, "extraargs");
+	argv_add(&args, "%s", imageoutfile(image));
+	if (!ret)
+		ret = run_argv(image, &args);
+	argv_free(&args);
+
+	return ret;
+}
+
+/*
+ * The files of the 'files' sections are added to a copy of the mountpath
+ * for this image only, so that other images built from the same
+ * mountpath don't get them. The copy is a hardlink farm where possible,
+ * the files are hardlinked or reflinked as well.
+ */
+static int ext2_stage_files(struct image *image, char **root)
+{
+	struct partition *part;
+	int ret;
+
+	asprintf(root, "%s/%s.root", tmppath(), image->file);
+
+	ret = copy_tree(mountpath(image), *root, 1);
+	if (ret)
+		return ret;
+
+	list_for_each_entry(part, &image->partitions, list) {
+		struct image *child = image_get(part->image);
+		const char *file = imageoutfile(child);
+		char *target, *dir;
+		struct stat s;
 
-    list_for_each_entry(part, &image->partitions, list) {
-        image_log(image, 1, "Entry start:\n");
-        struct image *child = image_get(part->image);
-        const char *file = imageoutfile(child);
-        const char *target = part->name;
-        char *path = strdupa(target);
-        char *next = path;
+		asprintf(&target, "%s/%s", *root, part->name);
 
-        image_log(image, 1, "Entry: Mountpath:%s File:%s Target:%s Path:%s Next:%s\n",
-		mountpath(image), file, target, path, next);
+		/* like rsync: a directory as target means 'into' */
+		if (part->name[strlen(part->name) - 1] == '/' ||
+				(!stat(target, &s) && S_ISDIR(s.st_mode))) {
+			const char *base = strrchr(file, '/');
+			char *tmp = target;
 
-        char target_filepath[1024];
+			asprintf(&target, "%s/%s", tmp, base ? base + 1 : file);
+			free(tmp);
+		}
 
-        strcpy(target_filepath,mountpath(image));
-        strcat(target_filepath,part->name);
+		image_log(image, 1, "adding file '%s' as '%s' ...\n",
+				child->file, part->name);
 
-        image_log(image, 1, "%s -av %s %s\n",
-			get_opt("rsync"),
-		    file,
-			target_filepath);
-        ret = systemp(image, "%s -av %s %s",
-			get_opt("rsync"),
-			file,
-			target_filepath);
+		dir = strdupa(target);
+		ret = mkdir_p(dirname(dir), 0755);
+		if (!ret)
+			ret = link_file(image, file, target);
+		free(target);
+		if (ret)
+			return ret;
+	}
 
-    }
+	return 0;
+}
+
+static int ext2_generate_genext2fs(struct image *image, const char *root)
+{
+	int ret;
+	struct argv args = {};
+	char *features = cfg_getstr(image->imagesec, "features");
+	char *label = cfg_getstr(image->imagesec, "label");
 
 	image_log(image, 1, "Generating ext2 image...\n");
-	ret = systemp(image, "%s -d %s --size-in-blocks=%lld -i 16384 %s %s",
-			get_opt("genext2fs"),
-			mountpath(image), image->size / 1024, imageoutfile(image),
-			extraargs);
+	argv_add_split(&args, get_opt("genext2fs"));
+	argv_add(&args, "-d");
+	argv_add(&args, "%s", root);
+	argv_add(&args, "--size-in-blocks=%lld", image->size / 1024);
+	argv_add(&args, "-i");
+	argv_add(&args, "16384");
+	argv_add(&args, "%s", imageoutfile(image));
+	ret = argv_add_opt(image, &args, "extraargs");
+	if (!ret)
+		ret = run_argv(image, &args);
+	argv_free(&args);
 
 	if (ret)
 		return ret;
@@ -90,16 +164,22 @@ static int ext2_generate(struct image *image)
 	if (features && features[0] != '\0') {
 		image_log(image, 1, "%s -O \"%s\" %s\n", get_opt("tune2fs"),
 				features, imageoutfile(image));
-		ret = systemp(image, "%s -O \"%s\" %s", get_opt("tune2fs"),
-				features, imageoutfile(image));
+		argv_add_split(&args, get_opt("tune2fs"));
+		argv_add(&args, "-O");
+		argv_add(&args, "%s", features);
+		argv_add(&args, "%s", imageoutfile(image));
+		ret = run_argv(image, &args);
 		if (ret)
 			return ret;
 	}
 	if (label && label[0] != '\0') {
 		image_log(image, 1, "%s -L \"%s\" %s\n", get_opt("tune2fs"),
 				label, imageoutfile(image));
-		ret = systemp(image, "%s -L \"%s\" %s", get_opt("tune2fs"),
-				label, imageoutfile(image));
+		argv_add_split(&args, get_opt("tune2fs"));
+		argv_add(&args, "-L");
+		argv_add(&args, "%s", label);
+		argv_add(&args, "%s", imageoutfile(image));
+		ret = run_argv(image, &args);
 		if (ret)
 			return ret;
 	}
@@ -107,13 +187,41 @@ static int ext2_generate(struct image *image)
     if (!list_empty(&image->partitions))
             return 0;
 
-	ret = systemp(image, "%s -pvfD %s", get_opt("e2fsck"),
-			imageoutfile(image));
-
 	/* e2fsck return 1 when the filesystem was successfully modified */
+	args.ok_status = 2;
+	argv_add_split(&args, get_opt("e2fsck"));
+	argv_add(&args, "-pvfD");
+	argv_add(&args, "%s", imageoutfile(image));
+	ret = run_argv(image, &args);
+
+	if (ret < 0)
+		return ret;
 	return ret > 2;
 }
 
+static int ext2_generate(struct image *image)
+{
+	const char *root = mountpath(image);
+	char *staged = NULL;
+	int ret;
+
+	if (!list_empty(&image->partitions)) {
+		ret = ext2_stage_files(image, &staged);
+		if (ret)
+			goto out;
+		root = staged;
+	}
+
+	if (cfg_getbool(image->imagesec, "use-mke2fs"))
+		ret = ext2_generate_mke2fs(image, root);
+	else
+		ret = ext2_generate_genext2fs(image, root);
+out:
+	free(staged);
+
+	return ret;
+}
+
 static int ext2_parse(struct image *image, cfg_t *cfg)
 {
 	unsigned int i, j;
@@ -162,6 +270,7 @@ static cfg_opt_t ext2_opts[] = {
 	CFG_STR("features", 0, CFGF_NONE),
 	CFG_STR("label", 0, CFGF_NONE),
 	CFG_SEC("files", files_opts, CFGF_MULTI | CFGF_TITLE),
+	CFG_BOOL("use-mke2fs", cfg_false, CFGF_NONE),
 	CFG_END()
 };
 
@@ -177,6 +286,7 @@ static cfg_opt_t ext3_opts[] = {
 	CFG_STR("features", "has_journal", CFGF_NONE),
 	CFG_STR("label", 0, CFGF_NONE),
 	CFG_SEC("files", files_opts, CFGF_MULTI | CFGF_TITLE),
+	CFG_BOOL("use-mke2fs", cfg_false, CFGF_NONE),
 	CFG_END()
 };
 
@@ -192,6 +302,7 @@ static cfg_opt_t ext4_opts[] = {
 	CFG_STR("features", "extents,uninit_bg,dir_index,has_journal", CFGF_NONE),
 	CFG_STR("label", 0, CFGF_NONE),
 	CFG_SEC("files", files_opts, CFGF_MULTI | CFGF_TITLE),
+	CFG_BOOL("use-mke2fs", cfg_false, CFGF_NONE),
 	CFG_END()
 };
 
@@ -32,7 +32,6 @@ struct file {
 static int file_generate(struct image *image)
 {
 	struct file *f = image->handler_priv;
-	int ret;
 
 	if (!f->copy)
 		return 0;
@@ -40,9 +39,7 @@ static int file_generate(struct image *image)
 	if (!strcmp(f->infile, imageoutfile(image)))
 		return 0;
 
-	ret = systemp(image, "cp %s %s",  f->infile, imageoutfile(image));
-
-	return ret;
+	return copy_file(image, f->infile, imageoutfile(image));
 }
 
 static int file_setup(struct image *image, cfg_t *cfg)
@@ -96,5 +93,6 @@ struct image_handler file_handler = {
 	.generate = file_generate,
 	.setup = file_setup,
 	.opts = file_opts,
+	.no_rootpath = cfg_true,
 };
 
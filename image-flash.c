@@ -22,51 +22,347 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 #include "list.h"
 #include "genimage.h"
 
 struct flash_image {
+	struct nand_ecc *ecc;
 };
 
-static int flash_generate(struct image *image)
+struct flash_copy {
+	struct image *image;
+	const char *outfile;
+	struct partition **parts;
+};
+
+/*
+ * Fill the gap before a partition with 0xff and copy its image. This may
+ * run in parallel with other partitions, so use a separate file descriptor:
+ * sendfile() changes the file position.
+ */
+static int flash_write_partition(void *priv, int i)
+{
+	struct flash_copy *copy = priv;
+	struct image *image = copy->image;
+	struct partition *part = copy->parts[i];
+	const char *outfile = copy->outfile;
+	unsigned long long start = 0;
+	struct image *child;
+	int fd, ret;
+
+	image_log(image, 1, "writing image partition '%s' (0x%llx@0x%llx)\n",
+		part->name, part->size, part->offset);
+
+	if (i) {
+		struct partition *prev = copy->parts[i - 1];
+
+		start = prev->offset;
+		if (prev->image)
+			start += prev->size;
+	}
+
+	fd = open(outfile, O_WRONLY);
+	if (fd < 0) {
+		image_error(image, "open %s: %s\n", outfile, strerror(errno));
+		return -errno;
+	}
+
+	ret = insert_fill(fd, start, part->offset - start, 0xFF);
+	if (ret) {
+		image_error(image, "failed to pad image to size %lld\n",
+				part->offset);
+		goto out;
+	}
+
+	if (!part->image)
+		goto out;
+
+	child = image_get(part->image);
+	if (!child) {
+		image_error(image, "could not find %s\n", part->name);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* the partitions are written concurrently, stay within this one */
+	if (child->size > part->size) {
+		image_error(image, "part %s size (%lld) too small for %s (%lld)\n",
+				part->name, part->size, child->file,
+				child->size);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ret = insert_image(image, fd, imageoutfile(child), part->size,
+			part->offset, 0xFF);
+	if (ret)
+		image_error(image, "failed to write image partition '%s'\n",
+				part->name);
+out:
+	if (close(fd) && !ret)
+		ret = -errno;
+
+	return ret;
+}
+
+/*
+ * The partition images are mapped completely, even where they contain
+ * holes: erased flash reads as 0xff, not as zeroes. The 0xff padding is
+ * not mapped.
+ */
+static int flash_write_bmap(struct image *image)
 {
+	struct bmap *bmap = bmap_new();
 	struct partition *part;
-	enum pad_mode mode = MODE_OVERWRITE;
-	const char *outfile = imageoutfile(image);
+	struct stat s;
+	int ret = 0;
 
 	list_for_each_entry(part, &image->partitions, list) {
-		struct image *child;
-		const char *infile;
-		int ret;
-
-		image_log(image, 1, "writing image partition '%s' (0x%llx@0x%llx)\n",
-			part->name, part->size, part->offset);
-
-		ret = pad_file(image, NULL, outfile, part->offset, 0xFF, mode);
-		if (ret) {
-			image_error(image, "failed to pad image to size %lld\n",
-					part->offset);
-			return ret;
+		if (!part->image)
+			continue;
+		if (stat(imageoutfile(image_get(part->image)), &s)) {
+			ret = -errno;
+			break;
 		}
-		mode = MODE_APPEND;
+		bmap_add_range(bmap, part->offset, part->offset + s.st_size);
+	}
 
-		if (!part->image)
+	if (!ret)
+		ret = bmap_write(image, bmap);
+	if (ret)
+		image_error(image, "failed to write block map: %s\n", strerror(-ret));
+
+	bmap_free(bmap);
+
+	return ret;
+}
+
+struct flash_oob {
+	struct image *image;
+	struct nand_ecc *ecc;
+	int in, out;
+	int ecc_offset;
+};
+
+/*
+ * Convert erase block 'i' of the main area image to pages followed by their
+ * OOB. Erased pages keep an erased OOB, everything else gets the ECC of its
+ * steps at 'ecc_offset' in the OOB and 0xff around it.
+ */
+static int flash_write_oob_block(void *priv, int i)
+{
+	struct flash_oob *oob = priv;
+	struct flash_type *flash = oob->image->flash_type;
+	int page = flash->minimum_io_unit_size, oobsize = flash->oob_size;
+	int pages = flash->pebsize / page, p, j;
+	unsigned char *in, *out;
+	ssize_t r;
+	int ret = 0;
+
+	in = xzalloc(flash->pebsize);
+	out = xzalloc(pages * (page + oobsize));
+
+	r = pread(oob->in, in, flash->pebsize, (off_t)i * flash->pebsize);
+	if (r != flash->pebsize) {
+		ret = r < 0 ? -errno : -EIO;
+		goto out;
+	}
+
+	memset(out, 0xff, pages * (page + oobsize));
+
+	for (p = 0; p < pages; p++) {
+		const unsigned char *data = in + p * page;
+		unsigned char *dst = out + p * (page + oobsize);
+		unsigned char *code = dst + page + oob->ecc_offset;
+
+		memcpy(dst, data, page);
+
+		/* erased: nothing to compute, the OOB stays erased */
+		if (data[0] == 0xff && !memcmp(data, data + 1, page - 1))
 			continue;
 
-		child = image_get(part->image);
-		if (!child) {
-			image_error(image, "could not find %s\n", part->name);
-			return -EINVAL;
+		if (!oob->ecc)
+			continue;
+
+		for (j = 0; j < page; j += nand_ecc_step(oob->ecc)) {
+			nand_ecc_calculate(oob->ecc, data + j, code);
+			code += nand_ecc_bytes(oob->ecc);
 		}
-		infile = imageoutfile(child);
+	}
 
-		ret = pad_file(image, infile, outfile, part->size, 0xFF, mode);
-		if (ret) {
-			image_error(image, "failed to write image partition '%s'\n",
-					part->name);
-			return ret;
+	r = pwrite(oob->out, out, pages * (page + oobsize),
+			(off_t)i * pages * (page + oobsize));
+	if (r != pages * (page + oobsize))
+		ret = r < 0 ? -errno : -EIO;
+out:
+	free(in);
+	free(out);
+
+	return ret;
+}
+
+static int flash_write_oob(struct image *image, const char *rawfile,
+		unsigned long long size)
+{
+	struct flash_image *f = image->handler_priv;
+	struct flash_oob oob = {
+		.image = image,
+		.ecc = f->ecc,
+		.ecc_offset = cfg_getint(image->imagesec, "ecc-offset"),
+	};
+	int ret;
+
+	oob.in = open(rawfile, O_RDONLY);
+	if (oob.in < 0) {
+		ret = -errno;
+		image_error(image, "open %s: %s\n", rawfile, strerror(errno));
+		return ret;
+	}
+
+	oob.out = open(imageoutfile(image), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (oob.out < 0) {
+		ret = -errno;
+		image_error(image, "open %s: %s\n", imageoutfile(image),
+				strerror(errno));
+		close(oob.in);
+		return ret;
+	}
+
+	if (oob.ecc_offset < 0 && f->ecc)
+		oob.ecc_offset = image->flash_type->oob_size -
+			image->flash_type->minimum_io_unit_size /
+			nand_ecc_step(f->ecc) * nand_ecc_bytes(f->ecc);
+
+	/* erase blocks are independent */
+	ret = run_parallel(size / image->flash_type->pebsize,
+			flash_write_oob_block, &oob);
+	if (ret)
+		image_error(image, "failed to write %s: %s\n",
+				imageoutfile(image), strerror(-ret));
+
+	close(oob.in);
+	if (close(oob.out) && !ret)
+		ret = -errno;
+
+	return ret;
+}
+
+static int flash_generate(struct image *image)
+{
+	struct flash_image *f = image->handler_priv;
+	struct partition *part;
+	const char *outfile = imageoutfile(image);
+	char *rawfile = NULL;
+	int oob = cfg_getbool(image->imagesec, "oob");
+	unsigned long long size = 0;
+	struct flash_copy copy = {
+		.image = image,
+	};
+	int fd, ret = 0, num = 0;
+
+	/* the main area goes to tmppath first, the output gets the OOB */
+	if (oob) {
+		asprintf(&rawfile, "%s/%s.main", tmppath(), image->file);
+		outfile = rawfile;
+	}
+	copy.outfile = outfile;
+
+	list_for_each_entry(part, &image->partitions, list) {
+		copy.parts = realloc(copy.parts, (num + 1) * sizeof(*copy.parts));
+		copy.parts[num++] = part;
+		size = part->offset;
+		if (part->image)
+			size += part->size;
+	}
+
+	fd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		image_error(image, "open %s: %s\n", outfile, strerror(errno));
+		ret = -errno;
+		goto out;
+	}
+
+	if (ftruncate(fd, size)) {
+		image_error(image, "failed to resize %s: %s\n", outfile,
+				strerror(errno));
+		ret = -errno;
+	}
+	close(fd);
+	if (ret)
+		goto out;
+
+	/* the partitions don't overlap, so they can be written concurrently */
+	ret = run_parallel(num, flash_write_partition, &copy);
+
+	if (!ret && oob)
+		ret = flash_write_oob(image, rawfile, size);
+
+	if (!ret && cfg_getbool(image->imagesec, "bmap"))
+		ret = flash_write_bmap(image);
+out:
+	if (rawfile)
+		unlink(rawfile);
+	free(rawfile);
+	free(copy.parts);
+
+	/* an image is generated once, the ECC tables are not needed again */
+	nand_ecc_free(f->ecc);
+	f->ecc = NULL;
+
+	return ret;
+}
+
+static int flash_setup_oob(struct image *image, cfg_t *cfg)
+{
+	struct flash_image *f = image->handler_priv;
+	struct flash_type *flash = image->flash_type;
+	char *algo = cfg_getstr(cfg, "ecc");
+	int page = flash->minimum_io_unit_size;
+	int step = cfg_getint(cfg, "ecc-step");
+	int offset = cfg_getint(cfg, "ecc-offset");
+	int bytes = 0;
+
+	if (cfg_getbool(cfg, "bmap")) {
+		image_error(image, "a block map can only be written without OOB\n");
+		return -EINVAL;
+	}
+
+	if (flash->oob_size <= 0 || page <= 0 || flash->pebsize % page) {
+		image_error(image, "flash type %s needs an oob-size and a "
+				"minimum-io-unit-size (page size) dividing "
+				"the pebsize\n", flash->name);
+		return -EINVAL;
+	}
+
+	if (strcmp(algo, "none")) {
+		if (!step)
+			step = strcmp(algo, "hamming") ? 512 : 256;
+		f->ecc = nand_ecc_new(algo, step,
+				cfg_getint(cfg, "ecc-strength"));
+		if (!f->ecc) {
+			image_error(image, "unsupported ECC %s with a step of "
+					"%d bytes\n", algo, step);
+			return -EINVAL;
 		}
+		if (page % step) {
+			image_error(image, "page size %d is not a multiple of "
+					"the ECC step %d\n", page, step);
+			nand_ecc_free(f->ecc);
+			f->ecc = NULL;
+			return -EINVAL;
+		}
+		bytes = page / step * nand_ecc_bytes(f->ecc);
+	}
+
+	if (offset < 0)
+		offset = flash->oob_size - bytes;
+	if (offset < 0 || offset + bytes > flash->oob_size) {
+		image_error(image, "%d ECC bytes at offset %d do not fit into "
+				"the %d byte OOB\n", bytes, offset,
+				flash->oob_size);
+		return -EINVAL;
 	}
 
 	return 0;
@@ -132,10 +428,19 @@ err_exceed:
 		return -EINVAL;
 	}
 
+	if (cfg_getbool(cfg, "oob"))
+		return flash_setup_oob(image, cfg);
+
 	return 0;
 }
 
 static cfg_opt_t flash_opts[] = {
+	CFG_BOOL("bmap", cfg_false, CFGF_NONE),
+	CFG_BOOL("oob", cfg_false, CFGF_NONE),
+	CFG_STR("ecc", "none", CFGF_NONE),
+	CFG_INT("ecc-step", 0, CFGF_NONE),
+	CFG_INT("ecc-strength", 4, CFGF_NONE),
+	CFG_INT("ecc-offset", -1, CFGF_NONE),
 	CFG_END()
 };
 
@@ -144,5 +449,6 @@ struct image_handler flash_handler = {
 	.generate = flash_generate,
 	.setup = flash_setup,
 	.opts = flash_opts,
+	.no_rootpath = cfg_true,
 };
 
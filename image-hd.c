@@ -21,11 +21,15 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "genimage.h"
 
 struct hdimage {
 	cfg_bool_t partition_table;
+	cfg_bool_t bmap;
+	const char *format;
 	unsigned long long align;
 	unsigned long long extended_lba;
 	uint32_t disksig;
@@ -144,78 +148,258 @@ static int hdimage_setup_ebr(struct image *image, struct partition *part, char *
 	return 0;
 }
 
-static int hdimage_generate(struct image *image)
+static int hdimage_write(struct image *image, int fd, const void *data,
+		size_t size, off_t offset)
+{
+	if (pwrite(fd, data, size, offset) != (ssize_t)size) {
+		image_error(image, "write %s: %s\n", imageoutfile(image),
+				strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+/*
+ * The image ends with the data of the last partition
+ */
+static unsigned long long hdimage_size(struct image *image)
 {
-	struct partition *part;
 	struct hdimage *hd = image->handler_priv;
-	enum pad_mode mode = MODE_OVERWRITE;
+	struct partition *part;
+	unsigned long long size = hd->partition_table ? 512 : 0;
+
+	list_for_each_entry(part, &image->partitions, list) {
+		unsigned long long end = part->offset;
+
+		if (part->image)
+			end += image_get(part->image)->size;
+		else if (!part->extended)
+			continue;
+
+		if (end > size)
+			size = end;
+	}
+
+	return size;
+}
+
+struct hdimage_copy {
+	struct image *image;
+	struct partition **parts;
+};
+
+/*
+ * Copy a partition image. This may run in parallel with other partitions,
+ * so use a separate file descriptor: sendfile() changes the file position.
+ */
+static int hdimage_insert_partition(void *priv, int i)
+{
+	struct hdimage_copy *copy = priv;
+	struct image *image = copy->image;
+	struct partition *part = copy->parts[i];
+	struct image *child = image_get(part->image);
 	const char *outfile = imageoutfile(image);
-	int ret;
+	int fd, ret;
+
+	image_log(image, 1, "adding partition '%s'%s from '%s' ...\n", part->name,
+			part->in_partition_table ? " (in MBR)" : "",
+			part->image);
+
+	fd = open(outfile, O_WRONLY);
+	if (fd < 0) {
+		image_error(image, "open %s: %s\n", outfile, strerror(errno));
+		return -errno;
+	}
+
+	ret = insert_image(image, fd, imageoutfile(child), child->size,
+			part->offset, 0x0);
+	if (ret)
+		image_error(image, "failed to write image partition '%s'\n",
+				part->name);
+
+	if (close(fd) && !ret)
+		ret = -errno;
+
+	return ret;
+}
+
+/*
+ * The partition tables and the data of the partition images are mapped,
+ * alignment gaps and holes in the partition images are not.
+ */
+static int hdimage_write_bmap(struct image *image)
+{
+	struct hdimage *hd = image->handler_priv;
+	struct bmap *bmap = bmap_new();
+	struct partition *part;
+	int ret = 0;
+
+	if (hd->partition_table)
+		bmap_add_range(bmap, 0, 512);
 
 	list_for_each_entry(part, &image->partitions, list) {
-		struct image *child;
-		const char *infile;
+		if (part->extended)
+			bmap_add_range(bmap, part->offset - hd->align,
+					part->offset - hd->align + 512);
+		if (!part->image)
+			continue;
+		ret = bmap_add_file(bmap, imageoutfile(image_get(part->image)),
+				part->offset);
+		if (ret)
+			break;
+	}
+
+	if (!ret)
+		ret = bmap_write(image, bmap);
+	if (ret)
+		image_error(image, "failed to write block map: %s\n", strerror(-ret));
+
+	bmap_free(bmap);
+
+	return ret;
+}
+
+/*
+ * Encode the disk image from its parts without writing a raw image first
+ */
+static int hdimage_generate_vdisk(struct image *image)
+{
+	struct hdimage *hd = image->handler_priv;
+	struct vdisk *vd = vdisk_new(hdimage_size(image));
+	struct partition *part;
+	int ret = 0;
 
-		image_log(image, 1, "adding partition '%s'%s%s%s%s ...\n", part->name,
+	list_for_each_entry(part, &image->partitions, list) {
+		image_log(image, 1, "adding partition '%s'%s%s%s ...\n", part->name,
 			part->in_partition_table ? " (in MBR)" : "",
-			part->image ? " from '": "",
-			part->image ? part->image : "",
-			part->image ? "'" : "");
+			part->image ? " from " : "",
+			part->image ? part->image : "");
+
+		if (part->extended) {
+			char ebr[4*sizeof(struct partition_entry)+2];
+			memset(ebr, 0, sizeof(ebr));
+			hdimage_setup_ebr(image, part, ebr);
+			vdisk_add_data(vd, ebr, sizeof(ebr),
+					part->offset - hd->align + 446);
+		}
+
+		if (part->image) {
+			struct image *child = image_get(part->image);
 
-		if (part->image || part->extended) {
-			ret = pad_file(image, NULL, outfile, part->offset, 0x0, mode);
+			ret = vdisk_add_file(vd, imageoutfile(child), child->size,
+					part->offset);
 			if (ret) {
-				image_error(image, "failed to pad image to size %lld\n",
-						part->offset);
-				return ret;
+				image_error(image, "failed to add image partition '%s': %s\n",
+						part->name, strerror(-ret));
+				goto out;
 			}
-			mode = MODE_APPEND;
 		}
+	}
+
+	if (hd->partition_table) {
+		char part_table[6+4*sizeof(struct partition_entry)+2];
+
+		memset(part_table, 0, sizeof(part_table));
+		ret = hdimage_setup_mbr(image, part_table);
+		if (ret)
+			goto out;
+
+		vdisk_add_data(vd, part_table, sizeof(part_table), 440);
+	}
+
+	image_log(image, 1, "writing %s image\n", hd->format);
+
+	if (!strcmp(hd->format, "android-sparse"))
+		ret = vdisk_write_android_sparse(image, vd);
+	else
+		ret = vdisk_write_qcow2(image, vd);
+out:
+	vdisk_free(vd);
+
+	return ret;
+}
+
+static int hdimage_generate(struct image *image)
+{
+	struct partition *part;
+	struct hdimage *hd = image->handler_priv;
+	const char *outfile = imageoutfile(image);
+	struct hdimage_copy copy = {
+		.image = image,
+	};
+	int fd, ret, num = 0;
+
+	if (strcmp(hd->format, "raw"))
+		return hdimage_generate_vdisk(image);
+
+	fd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		image_error(image, "open %s: %s\n", outfile, strerror(errno));
+		return -errno;
+	}
+
+	/* sized up front, everything not written below stays a hole */
+	if (ftruncate(fd, hdimage_size(image))) {
+		ret = -errno;
+		image_error(image, "failed to resize %s: %s\n", outfile,
+				strerror(errno));
+		goto out;
+	}
+
+	list_for_each_entry(part, &image->partitions, list) {
+		if (!part->image)
+			image_log(image, 1, "adding partition '%s'%s ...\n", part->name,
+				part->in_partition_table ? " (in MBR)" : "");
 
 		if (part->extended) {
 			char ebr[4*sizeof(struct partition_entry)+2];
 			memset(ebr, 0, sizeof(ebr));
 			ret = hdimage_setup_ebr(image, part, ebr);
-			ret = insert_data(image, ebr, outfile, sizeof(ebr),
+			ret = hdimage_write(image, fd, ebr, sizeof(ebr),
 					part->offset - hd->align + 446);
 			if (ret) {
 				image_error(image, "failed to write EBR\n");
-				return ret;
+				goto out;
 			}
 		}
 
-		if (!part->image)
-			continue;
-
-		child = image_get(part->image);
-		infile = imageoutfile(child);
-
-		ret = pad_file(image, infile, outfile, child->size, 0x0, MODE_APPEND);
-
-		if (ret) {
-			image_error(image, "failed to write image partition '%s'\n",
-					part->name);
-			return ret;
+		if (part->image) {
+			copy.parts = realloc(copy.parts, (num + 1) * sizeof(*copy.parts));
+			copy.parts[num++] = part;
 		}
 	}
 
+	/* the partitions don't overlap, so their contents can be copied concurrently */
+	ret = run_parallel(num, hdimage_insert_partition, &copy);
+	if (ret)
+		goto out;
+
 	if (hd->partition_table) {
 		char part_table[6+4*sizeof(struct partition_entry)+2];
 
 		memset(part_table, 0, sizeof(part_table));
 		ret = hdimage_setup_mbr(image, part_table);
 		if (ret)
-			return ret;
+			goto out;
 
-		ret = insert_data(image, part_table, outfile, sizeof(part_table), 440);
+		ret = hdimage_write(image, fd, part_table, sizeof(part_table), 440);
 		if (ret) {
 			image_error(image, "failed to write MBR\n");
-			return ret;
+			goto out;
 		}
-		mode = MODE_APPEND;
 	}
 
-	return 0;
+	ret = 0;
+out:
+	free(copy.parts);
+	if (close(fd) && !ret)
+		ret = -errno;
+
+	if (!ret && hd->bmap)
+		ret = hdimage_write_bmap(image);
+
+	return ret;
 }
 
 static unsigned long long roundup(unsigned long long value, unsigned long long align)
@@ -233,6 +417,8 @@ static int hdimage_setup(struct image *image, cfg_t *cfg)
 
 	hd->align = cfg_getint_suffix(cfg, "align");
 	hd->partition_table = cfg_getbool(cfg, "partition-table");
+	hd->bmap = cfg_getbool(cfg, "bmap");
+	hd->format = cfg_getstr(cfg, "output-format");
 	hd->disksig = strtoul(cfg_getstr(cfg, "disk-signature"), NULL, 0);
 
 	if ((hd->align % 512) || (hd->align == 0)) {
@@ -240,6 +426,15 @@ static int hdimage_setup(struct image *image, cfg_t *cfg)
 				"multiple of 1 sector (512 bytes)\n", hd->align);
 		return -EINVAL;
 	}
+	if (strcmp(hd->format, "raw") && strcmp(hd->format, "android-sparse") &&
+			strcmp(hd->format, "qcow2")) {
+		image_error(image, "unknown output format '%s'\n", hd->format);
+		return -EINVAL;
+	}
+	if (hd->bmap && strcmp(hd->format, "raw")) {
+		image_error(image, "a block map can only be written for raw images\n");
+		return -EINVAL;
+	}
 	list_for_each_entry(part, &image->partitions, list) {
 		if (part->in_partition_table)
 			++partition_table_entries;
@@ -260,6 +455,14 @@ static int hdimage_setup(struct image *image, cfg_t *cfg)
 				else
 					part->size = child->size;
 			}
+			/* written concurrently, it must not reach the next one */
+			if (child->size > part->size) {
+				image_error(image, "part %s size (%lld) too small "
+						"for %s (%lld)\n", part->name,
+						part->size, child->file,
+						child->size);
+				return -EINVAL;
+			}
 		}
 		if (!part->size) {
 			image_error(image, "part %s size must not be zero\n",
@@ -317,6 +520,8 @@ cfg_opt_t hdimage_opts[] = {
 	CFG_STR("align", "512", CFGF_NONE),
 	CFG_STR("disk-signature", "", CFGF_NONE),
 	CFG_BOOL("partition-table", cfg_true, CFGF_NONE),
+	CFG_BOOL("bmap", cfg_false, CFGF_NONE),
+	CFG_STR("output-format", "raw", CFGF_NONE),
 	CFG_END()
 };
 
@@ -325,5 +530,6 @@ struct image_handler hdimage_handler = {
 	.generate = hdimage_generate,
 	.setup = hdimage_setup,
 	.opts = hdimage_opts,
+	.no_rootpath = cfg_true,
 };
 
@@ -19,42 +19,156 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include "genimage.h"
 
+/*
+ * remove a staging directory below tmppath left from an earlier build
+ */
+static int iso_clean(const char *path)
+{
+	int ret;
+
+	ret = remove_tree_contents(path);
+	if (ret)
+		return ret;
+	if (rmdir(path) && errno != ENOENT)
+		return -errno;
+
+	return 0;
+}
+
+/*
+ * With 'dedup', the root is copied to tmppath and identical files are
+ * hardlinked there, both backends then store their data once. It is a
+ * copy, not a hardlink farm, so that the link counts recorded in the
+ * image only reflect the tree itself and the deduplication. With 'zisofs',
+ * mkzftree compresses the files into another staging directory, keeping
+ * hardlinks, and the backend is told to mark them as compressed.
+ */
+static int iso_stage(struct image *image, char **root, char **zroot)
+{
+	struct argv args = {};
+	int ret;
+
+	if (cfg_getbool(image->imagesec, "dedup")) {
+		asprintf(root, "%s/%s.root", tmppath(), image->file);
+		ret = iso_clean(*root);
+		if (!ret)
+			ret = copy_tree(mountpath(image), *root, 0);
+		if (!ret)
+			ret = dedup_tree(image, *root);
+		if (ret)
+			return ret;
+	} else {
+		*root = strdup(mountpath(image));
+	}
+
+	if (!cfg_getbool(image->imagesec, "zisofs"))
+		return 0;
+
+	asprintf(zroot, "%s/%s.zisofs", tmppath(), image->file);
+	ret = iso_clean(*zroot);
+	if (ret)
+		return ret;
+
+	argv_add_split(&args, get_opt("mkzftree"));
+	argv_add(&args, "-p");
+	argv_add(&args, "%d", get_jobs());
+	argv_add(&args, "%s", *root);
+	argv_add(&args, "%s", *zroot);
+	ret = run_argv(image, &args);
+	argv_free(&args);
+
+	return ret;
+}
+
 static int iso_generate(struct image *image)
 {
+	struct argv args = {};
 	int ret;
+	char *backend = cfg_getstr(image->imagesec, "backend");
 	char *boot_image = cfg_getstr(image->imagesec, "boot-image");
-	char *bootargs = cfg_getstr(image->imagesec, "bootargs");
-	char *extraargs = cfg_getstr(image->imagesec, "extraargs");
 	char *input_charset = cfg_getstr(image->imagesec, "input-charset");
 	char *volume_id = cfg_getstr(image->imagesec, "volume-id");
+	char *root = NULL, *zroot = NULL;
+
+	ret = iso_stage(image, &root, &zroot);
+	if (ret)
+		goto out;
+
+	if (!strcmp(backend, "xorriso")) {
+		argv_add_split(&args, get_opt("xorriso"));
+		argv_add(&args, "-as");
+		argv_add(&args, "mkisofs");
+		/* record hardlinks in Rock Ridge like genisoimage */
+		argv_add(&args, "--hardlinks");
+	} else {
+		argv_add_split(&args, get_opt("genisoimage"));
+	}
+	argv_add(&args, "-input-charset");
+	argv_add(&args, "%s", input_charset);
+	argv_add(&args, "-R");
+	argv_add(&args, "-hide-rr-moved");
+	if (zroot)
+		argv_add(&args, "-z");
+	if (boot_image) {
+		argv_add(&args, "-b");
+		argv_add(&args, "%s", boot_image);
+		ret = argv_add_opt(image, &args, "bootargs");
+		if (ret)
+			goto out;
+	}
+	argv_add(&args, "-V");
+	argv_add(&args, "%s", volume_id);
+	ret = argv_add_opt(image, &args, "extraargs");
+	if (ret)
+		goto out;
+	argv_add(&args, "-o");
+	argv_add(&args, "%s", imageoutfile(image));
+	argv_add(&args, "%s", zroot ? zroot : root);
+
+	ret = run_argv(image, &args);
+out:
+	argv_free(&args);
+	if (zroot)
+		iso_clean(zroot);
+	if (root && strcmp(root, mountpath(image)))
+		iso_clean(root);
+	free(zroot);
+	free(root);
 
-	ret = systemp(image, "%s -input-charset %s -R -hide-rr-moved %s %s %s -V '%s' %s -o %s %s",
-			get_opt("genisoimage"),
-			input_charset,
-			boot_image ? "-b" : "",
-			boot_image ? boot_image : "",
-			boot_image ? bootargs : "",
-			volume_id,
-			extraargs,
-			imageoutfile(image),
-			mountpath(image));
 	return ret;
 }
 
+static int iso_setup(struct image *image, cfg_t *cfg)
+{
+	char *backend = cfg_getstr(cfg, "backend");
+
+	if (strcmp(backend, "genisoimage") && strcmp(backend, "xorriso")) {
+		image_error(image, "backend must be genisoimage or xorriso\n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
 static cfg_opt_t iso_opts[] = {
+	CFG_STR("backend", "genisoimage", CFGF_NONE),
 	CFG_STR("boot-image", 0, CFGF_NONE),
 	CFG_STR("bootargs", "-no-emul-boot -boot-load-size 4 -boot-info-table -c boot.cat -hide boot.cat", CFGF_NONE),
 	CFG_STR("extraargs", "", CFGF_NONE),
 	CFG_STR("input-charset", "default", CFGF_NONE),
 	CFG_STR("volume-id", "", CFGF_NONE),
+	CFG_BOOL("dedup", cfg_false, CFGF_NONE),
+	CFG_BOOL("zisofs", cfg_false, CFGF_NONE),
 	CFG_END()
 };
 
 struct image_handler iso_handler = {
 	.type = "iso",
+	.setup = iso_setup,
 	.generate = iso_generate,
 	.opts = iso_opts,
 };
@@ -22,33 +22,102 @@
 
 #include "genimage.h"
 
+static void jffs2_add_endianness(struct image *image, struct argv *args)
+{
+	char *endianness = cfg_getstr(image->imagesec, "endianness");
+
+	if (!strcmp(endianness, "little"))
+		argv_add(args, "-l");
+	else if (!strcmp(endianness, "big"))
+		argv_add(args, "-b");
+}
+
+/*
+ * Erase block summaries are added by sumtool, so with 'summary' set
+ * mkfs.jffs2 writes to tmppath first.
+ */
 static int jffs2_generate(struct image *image)
 {
+	struct argv args = {};
 	int ret;
-	char *extraargs;
+	char *mode, *outfile;
+	int pad = cfg_getbool(image->imagesec, "pad");
+	int summary = cfg_getbool(image->imagesec, "summary");
+
+	mode = cfg_getstr(image->imagesec, "compression-mode");
 
-	extraargs = cfg_getstr(image->imagesec, "extraargs");
+	if (summary)
+		asprintf(&outfile, "%s/%s.nosum", tmppath(), image->file);
+	else
+		outfile = strdup(imageoutfile(image));
 
-	ret = systemp(image, "%s --eraseblock=%d -d %s -o %s %s",
-			get_opt("mkfsjffs2"),
-			image->flash_type->pebsize, mountpath(image), imageoutfile(image),
-			extraargs);
+	argv_add_split(&args, get_opt("mkfsjffs2"));
+	argv_add(&args, "--eraseblock=%d", image->flash_type->pebsize);
+	jffs2_add_endianness(image, &args);
+	if (pad && !summary && image->size)
+		argv_add(&args, "--pad=%llu", image->size);
+	else if (pad && !summary)
+		argv_add(&args, "--pad");
+	if (*mode)
+		argv_add(&args, "--compression-mode=%s", mode);
+	argv_add(&args, "-d");
+	argv_add(&args, "%s", mountpath(image));
+	argv_add(&args, "-o");
+	argv_add(&args, "%s", outfile);
+	ret = argv_add_opt(image, &args, "extraargs");
+	if (!ret)
+		ret = run_argv(image, &args);
+	argv_free(&args);
+
+	if (ret || !summary)
+		goto out;
+
+	argv_add_split(&args, get_opt("sumtool"));
+	argv_add(&args, "--eraseblock=%d", image->flash_type->pebsize);
+	jffs2_add_endianness(image, &args);
+	if (pad)
+		argv_add(&args, "--pad");
+	argv_add(&args, "-i");
+	argv_add(&args, "%s", outfile);
+	argv_add(&args, "-o");
+	argv_add(&args, "%s", imageoutfile(image));
+	ret = run_argv(image, &args);
+	unlink(outfile);
+
+	/* sumtool only pads to the end of the last erase block */
+	if (!ret && pad && image->size)
+		ret = pad_file(image, NULL, imageoutfile(image), image->size,
+				0xff, MODE_APPEND);
+out:
+	free(outfile);
 
 	return ret;
 }
 
 static int jffs2_setup(struct image *image, cfg_t *cfg)
 {
+	char *endianness = cfg_getstr(cfg, "endianness");
+
 	if (!image->flash_type) {
 		image_error(image, "no flash type given\n");
 		return -EINVAL;
 	}
 
+	if (*endianness && strcmp(endianness, "little") &&
+			strcmp(endianness, "big")) {
+		image_error(image, "endianness must be little or big\n");
+		return -EINVAL;
+	}
+
 	return 0;
 }
 
 static cfg_opt_t jffs2_opts[] = {
 	CFG_STR("extraargs", "", CFGF_NONE),
+	CFG_BOOL("pad", cfg_false, CFGF_NONE),
+	CFG_STR("endianness", "", CFGF_NONE),
+	CFG_BOOL("summary", cfg_false, CFGF_NONE),
+	CFG_STR("compression-mode", "", CFGF_NONE),
 	CFG_END()
 };
 
@@ -19,6 +19,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include "genimage.h"
 
@@ -26,28 +27,74 @@
 #define RAUC_KEY	1
 #define RAUC_CERT	2
 
+/*
+ * The given manifest followed by an [image.<slotclass>] section for each
+ * file with a slotclass. Hashes and sizes are left to 'rauc bundle', which
+ * computes them for every image section anyway.
+ */
+static char *rauc_manifest(struct image *image)
+{
+	char *manifest = strdup(cfg_getstr(image->imagesec, "manifest"));
+	unsigned int i;
+	char *str;
+
+	for (i = 0; i < cfg_size(image->imagesec, "file"); i++) {
+		cfg_t *filesec = cfg_getnsec(image->imagesec, "file", i);
+		const char *slotclass = cfg_getstr(filesec, "slotclass");
+
+		if (!slotclass)
+			continue;
+
+		asprintf(&str, "%s\n[image.%s]\nfilename=%s\n", manifest,
+				slotclass, cfg_title(filesec));
+		free(manifest);
+		manifest = str;
+	}
+
+	return manifest;
+}
+
+/*
+ * The bundle directory is a private copy of the mountpath in tmppath, so
+ * that the manifest and the content files don't show up in the shared
+ * mountpath other images are built from, maybe at the same time. The
+ * content files are hardlinked into it, or reflinked if tmppath is on
+ * another filesystem than the images, so that only rauc reads them. The
+ * directory is removed right after 'rauc bundle', nothing may write to
+ * the links to the child images.
+ */
 static int rauc_generate(struct image *image)
 {
 	int ret;
 	struct partition *part;
-	char *extraargs = cfg_getstr(image->imagesec, "extraargs");
-	char *manifest = cfg_getstr(image->imagesec, "manifest");
+	struct argv args = {};
 	char *cert = cfg_getstr(image->imagesec, "cert");
 	char *key = cfg_getstr(image->imagesec, "key");
-	char *manifest_file;
+	char *manifest = rauc_manifest(image);
+	char *root, *manifest_file;
 
 	image_log(image, 2, "manifest = '%s'\n", manifest);
 
-	asprintf(&manifest_file, "%s/manifest.raucm", mountpath(image));
+	asprintf(&root, "%s/%s.rauc", tmppath(), image->file);
+	asprintf(&manifest_file, "%s/manifest.raucm", root);
+
+	ret = remove_tree_contents(root);
+	if (!ret)
+		ret = copy_tree(mountpath(image), root, 1);
+	if (ret)
+		goto out;
+
+	/* may be a hardlink into the mountpath */
+	unlink(manifest_file);
 	ret = insert_data(image, manifest, manifest_file, strlen(manifest), 0);
 	if (ret)
-		return ret;
+		goto out;
 
 	list_for_each_entry(part, &image->partitions, list) {
 		struct image *child = image_get(part->image);
 		const char *file = imageoutfile(child);
 		const char *target = part->name;
-		char *path, *tmp;
+		char *path, *tmp, *dest;
 
 		if (part->partition_type != RAUC_CONTENT)
 			continue;
@@ -66,25 +113,40 @@ static int rauc_generate(struct image *image)
 		tmp = strrchr(path, '/');
 		if (tmp) {
 			*tmp = '\0';
-			ret = systemp(image, "mkdir -p %s/%s",
-					mountpath(image), path);
+			asprintf(&dest, "%s/%s", root, path);
+			ret = mkdir_p(dest, 0777);
+			free(dest);
 			if (ret)
-				return ret;
+				goto out;
 		}
 
 		image_log(image, 1, "adding file '%s' as '%s' ...\n",
 				child->file, target);
-		ret = systemp(image, "cp --remove-destination '%s' '%s/%s'",
-				file, mountpath(image), target);
+		asprintf(&dest, "%s/%s", root, target);
+		ret = link_file(image, file, dest);
+		free(dest);
 		if (ret)
-			return ret;
+			goto out;
 	}
 
-	systemp(image, "rm -f %s", imageoutfile(image));
-
-	ret = systemp(image, "%s bundle '%s' --cert='%s' --key='%s' %s '%s'",
-			get_opt("rauc"), mountpath(image), cert, key,
-			extraargs, imageoutfile(image));
+	unlink(imageoutfile(image));
+
+	argv_add_split(&args, get_opt("rauc"));
+	argv_add(&args, "bundle");
+	argv_add(&args, "%s", root);
+	argv_add(&args, "--cert=%s", cert);
+	argv_add(&args, "--key=%s", key);
+	ret = argv_add_opt(image, &args, "extraargs");
+	argv_add(&args, "%s", imageoutfile(image));
+	if (!ret)
+		ret = run_argv(image, &args);
+	argv_free(&args);
+out:
+	remove_tree_contents(root);
+	rmdir(root);
+	free(manifest_file);
+	free(manifest);
+	free(root);
 
 	return ret;
 }
@@ -137,6 +199,7 @@ static int rauc_parse(struct image *image, cfg_t *cfg)
 
 static cfg_opt_t file_opts[] = {
 	CFG_STR("image", NULL, CFGF_NONE),
+	CFG_STR("slotclass", NULL, CFGF_NONE),
 	CFG_END()
 };
 
@@ -146,7 +209,7 @@ static cfg_opt_t rauc_opts[] = {
 	CFG_SEC("file", file_opts, CFGF_MULTI | CFGF_TITLE),
 	CFG_STR("key", NULL, CFGF_NONE),
 	CFG_STR("cert", NULL, CFGF_NONE),
-	CFG_STR("manifest", NULL, CFGF_NONE),
+	CFG_STR("manifest", "", CFGF_NONE),
 	CFG_END()
 };
 
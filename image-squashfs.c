@@ -19,15 +19,203 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 #include "genimage.h"
+#include "sha256.h"
+
+/*
+ * Incremental builds: with 'append' set and a cachepath, the image and a
+ * manifest of the options and top-level entries it was built from are
+ * kept in the cache as the base for the next build. If the next build
+ * only adds top-level entries, they are appended to a copy of the base
+ * instead of building the image from scratch. mksquashfs appends to the
+ * root directory only, so a change anywhere else needs a full build.
+ */
+
+/* bumped when the meaning of the manifest changes, to force a full build */
+#define SQUASH_MANIFEST_VERSION	"squashfs-append-2"
+
+static char *squash_base(struct image *image, const char *suffix)
+{
+	char *path;
+
+	asprintf(&path, "%s/%s.base%s", get_opt("cachepath"),
+			image->file, suffix);
+
+	return path;
+}
+
+/*
+ * one "<digest> <name>" line per top-level entry, sorted, after a version,
+ * the options and the attributes of the root directory. The digests cover
+ * the contents of the files, not only their size and mtime, as a stale
+ * entry in the base would silently end up in the image.
+ */
+static char *squash_manifest(struct image *image, struct argv *opts)
+{
+	char hex[2 * SHA256_DIGEST_SIZE + 1];
+	struct dirent **names;
+	char *buf = NULL;
+	size_t size = 0;
+	struct stat s;
+	FILE *f;
+	int i, n, ret = 0;
+
+	if (stat(mountpath(image), &s))
+		return NULL;
+
+	n = scandir(mountpath(image), &names, NULL, alphasort);
+	if (n < 0)
+		return NULL;
+
+	f = open_memstream(&buf, &size);
+	fprintf(f, "%s\n", SQUASH_MANIFEST_VERSION);
+	for (i = 0; i < opts->argc; i++)
+		fprintf(f, "%s%s", i ? " " : "", opts->argv[i]);
+	fprintf(f, "\n%o %u %u\n", s.st_mode, s.st_uid, s.st_gid);
+
+	for (i = 0; i < n; i++) {
+		const char *name = names[i]->d_name;
+		char *path;
+
+		if (!ret && strcmp(name, ".") && strcmp(name, "..")) {
+			asprintf(&path, "%s/%s", mountpath(image), name);
+			ret = cache_tree_digest(path, hex);
+			fprintf(f, "%s %s\n", hex, name);
+			free(path);
+		}
+		free(names[i]);
+	}
+	free(names);
+	fclose(f);
+
+	if (ret) {
+		free(buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+static char *read_manifest(const char *file)
+{
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *in, *out;
+	char chunk[4096];
+	size_t r;
+
+	in = fopen(file, "r");
+	if (!in)
+		return NULL;
+
+	out = open_memstream(&buf, &size);
+	while ((r = fread(chunk, 1, sizeof(chunk), in)) > 0)
+		fwrite(chunk, 1, r, out);
+	fclose(out);
+	fclose(in);
+
+	return buf;
+}
+
+/*
+ * Add the top-level entries which are in 'manifest' but not in 'base' to
+ * 'args'. Returns the number of entries added or -1 if 'manifest' is not
+ * 'base' plus some entries.
+ */
+static int squash_new_entries(struct image *image, const char *base,
+		const char *manifest, struct argv *args)
+{
+	const char *b = base, *m = manifest;
+	int lines = 0, added = 0;
+
+	while (*m) {
+		size_t blen = strcspn(b, "\n"), mlen = strcspn(m, "\n");
+
+		if (*b && blen == mlen && !strncmp(b, m, mlen)) {
+			b += blen + !!b[blen];
+		} else if (lines < 3) {
+			/* version, options or root directory changed */
+			return -1;
+		} else {
+			/* skip the digest */
+			const char *name = m + 2 * SHA256_DIGEST_SIZE + 1;
+
+			argv_add(args, "%s/%.*s", mountpath(image),
+					(int)(m + mlen - name), name);
+			added++;
+		}
+		m += mlen + !!m[mlen];
+		lines++;
+	}
+
+	return *b ? -1 : added;
+}
+
+static int squash_store_base(struct image *image, const char *manifest)
+{
+	char *base = squash_base(image, ""), *list = squash_base(image, ".manifest");
+	char *tmp;
+	FILE *f;
+	int ret;
+
+	asprintf(&tmp, "%s.%d.tmp", base, (int)getpid());
+
+	/* drop the old manifest first, it must never describe another image */
+	unlink(list);
+
+	ret = mkdir_p(get_opt("cachepath"), 0755);
+	if (!ret)
+		ret = copy_file(image, imageoutfile(image), tmp);
+	if (!ret && rename(tmp, base))
+		ret = -errno;
+	if (!ret) {
+		f = fopen(list, "w");
+		if (!f || fputs(manifest, f) < 0)
+			ret = -EIO;
+		if (f && fclose(f) && !ret)
+			ret = -errno;
+		if (ret)
+			unlink(list);
+	}
+	if (ret) {
+		image_error(image, "failed to store %s: %s\n", base, strerror(-ret));
+		unlink(tmp);
+	}
+
+	free(tmp);
+	free(base);
+	free(list);
+
+	return ret;
+}
+
+static const char *squash_default_block_size(const char *comp)
+{
+	/* xz compresses considerably better with large blocks */
+	if (!strcasecmp(comp, "xz"))
+		return "1M";
+
+	return "128k";
+}
 
 static int squash_generate(struct image *image)
 {
-	char *extraargs = cfg_getstr(image->imagesec, "extraargs");
-	char compression[128];
+	struct argv args = {}, opts = {}, added_args = {};
 	char *comp_setup = cfg_getstr(image->imagesec, "compression");
-	unsigned block_size = cfg_getint_suffix(image->imagesec, "block-size");
+	const char *block_size_str = cfg_getstr(image->imagesec, "block-size");
+	char *processors = cfg_getstr(image->imagesec, "processors");
+	char *mem = cfg_getstr(image->imagesec, "mem");
+	int append = cfg_getbool(image->imagesec, "append");
+	char *manifest = NULL, *base = NULL, *old = NULL;
+	unsigned long long block_size;
+	int ret, i, added = -1;
+
+	if (!*block_size_str)
+		block_size_str = squash_default_block_size(comp_setup);
+	block_size = strtoul_suffix(block_size_str, NULL, 0);
 
 	/*
 	 * 'mksquashfs' currently defaults to 'gzip' compression. Provide a shortcut
@@ -35,16 +223,89 @@ static int squash_generate(struct image *image)
 	 * default behaviour for the future. Disabling compression is very useful
 	 * to handle binary diffs.
 	 */
-	if (!strcasecmp(comp_setup, "none"))
-		strncpy(compression, "-comp gzip -noInodeCompression -noDataCompression -noFragmentCompression -noXattrCompression", sizeof(compression));
-	else
-		snprintf(compression, sizeof(compression), "-comp %s", comp_setup);
-
-	return systemp(image, "%s %s %s -b %u -noappend %s %s",
-			get_opt("mksquashfs"),
-			mountpath(image), /* source dir */
-			imageoutfile(image), /* destination file */
-			block_size, compression, extraargs);
+	argv_add(&opts, "-b");
+	argv_add(&opts, "%llu", block_size);
+	argv_add(&opts, "-comp");
+	if (!strcasecmp(comp_setup, "none")) {
+		argv_add(&opts, "gzip");
+		argv_add(&opts, "-noInodeCompression");
+		argv_add(&opts, "-noDataCompression");
+		argv_add(&opts, "-noFragmentCompression");
+		argv_add(&opts, "-noXattrCompression");
+	} else {
+		argv_add(&opts, "%s", comp_setup);
+	}
+	if (*processors) {
+		argv_add(&opts, "-processors");
+		argv_add(&opts, "%s", processors);
+	}
+	if (*mem) {
+		argv_add(&opts, "-mem");
+		argv_add(&opts, "%s", mem);
+	}
+	if (!cfg_getbool(image->imagesec, "xattrs"))
+		argv_add(&opts, "-no-xattrs");
+	ret = argv_add_opt(image, &opts, "extraargs");
+	if (ret)
+		goto out;
+
+	if (append && !get_opt("cachepath")) {
+		image_log(image, 1, "append needs a cachepath, building from scratch\n");
+		append = 0;
+	}
+
+	argv_add_split(&args, get_opt("mksquashfs"));
+
+	if (append) {
+		char *list = squash_base(image, ".manifest");
+
+		manifest = squash_manifest(image, &opts);
+		base = squash_base(image, "");
+		if (manifest)
+			old = read_manifest(list);
+		free(list);
+	}
+
+	if (old)
+		added = squash_new_entries(image, old, manifest, &added_args);
+
+	if (added >= 0) {
+		if (added)
+			image_log(image, 1, "appending %d new entries to %s\n",
+					added, base);
+		else
+			image_log(image, 1, "reusing unchanged %s\n", base);
+		ret = copy_file(image, base, imageoutfile(image));
+		if (ret || !added)
+			goto store;
+		for (i = 0; i < added_args.argc; i++)
+			argv_add(&args, "%s", added_args.argv[i]);
+	} else {
+		argv_add(&args, "%s", mountpath(image)); /* source dir */
+	}
+	argv_add(&args, "%s", imageoutfile(image)); /* destination file */
+	if (added < 0)
+		argv_add(&args, "-noappend");
+	/* a single directory would be added by its contents otherwise */
+	if (added == 1)
+		argv_add(&args, "-keep-as-directory");
+	for (i = 0; i < opts.argc; i++)
+		argv_add(&args, "%s", opts.argv[i]);
+
+	ret = run_argv(image, &args);
+store:
+	/* nothing appended, the base is still up to date */
+	if (!ret && manifest && added)
+		ret = squash_store_base(image, manifest);
+out:
+	argv_free(&args);
+	argv_free(&opts);
+	argv_free(&added_args);
+	free(manifest);
+	free(base);
+	free(old);
+
+	return ret;
 }
 
 /**
@@ -54,7 +315,11 @@ static int squash_generate(struct image *image)
 static cfg_opt_t squash_opts[] = {
 	CFG_STR("extraargs", "", CFGF_NONE),
 	CFG_STR("compression", "gzip", CFGF_NONE),
-	CFG_STR("block-size", "4096", CFGF_NONE),
+	CFG_STR("block-size", "", CFGF_NONE),
+	CFG_STR("processors", "", CFGF_NONE),
+	CFG_STR("mem", "", CFGF_NONE),
+	CFG_BOOL("xattrs", cfg_true, CFGF_NONE),
+	CFG_BOOL("append", cfg_false, CFGF_NONE),
 	CFG_END()
 };
 
@@ -22,30 +22,100 @@
 
 #include "genimage.h"
 
+/*
+ * Compressors, run by tar through -I. xz and zstd compress on all CPUs.
+ */
+static const struct {
+	const char *name;
+	const char *cmd;
+	const char *suffixes[3];
+} tar_compressors[] = {
+	{ "gzip", "gzip", { ".tar.gz", "tgz" } },
+	{ "bzip2", "bzip2", { ".tar.bz2" } },
+	{ "xz", "xz -T0", { ".tar.xz", ".txz" } },
+	{ "zstd", "zstd -T0", { ".tar.zst" } },
+	{ "lz4", "lz4", { ".tar.lz4" } },
+};
+
+static int tar_setup(struct image *image, cfg_t *cfg)
+{
+	char *compression = cfg_getstr(cfg, "compression");
+	char *level = cfg_getstr(cfg, "level");
+	unsigned int i, j;
+
+	if (level[strspn(level, "0123456789")]) {
+		image_error(image, "invalid compression level '%s'\n", level);
+		return -EINVAL;
+	}
+
+	if (!strcmp(compression, "none"))
+		return 0;
+
+	for (i = 0; i < ARRAY_SIZE(tar_compressors); i++) {
+		if (*compression) {
+			if (!strcmp(compression, tar_compressors[i].name))
+				break;
+			continue;
+		}
+		for (j = 0; j < ARRAY_SIZE(tar_compressors[i].suffixes); j++)
+			if (tar_compressors[i].suffixes[j] &&
+					strstr(image->file, tar_compressors[i].suffixes[j]))
+				break;
+		if (j < ARRAY_SIZE(tar_compressors[i].suffixes))
+			break;
+	}
+
+	if (i < ARRAY_SIZE(tar_compressors)) {
+		image->handler_priv = (void *)tar_compressors[i].cmd;
+	} else if (*compression) {
+		image_error(image, "unknown compression '%s'\n", compression);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
 static int tar_generate(struct image *image)
 {
-	int ret;
-	char *comp = "";
+	struct argv args = {};
+	const char *cmd = image->handler_priv;
+	char *compressor = cfg_getstr(image->imagesec, "compressor");
+	char *level = cfg_getstr(image->imagesec, "level");
+	char *format = cfg_getstr(image->imagesec, "format");
 
-	if (strstr(image->file, ".tar.gz") || strstr(image->file, "tgz"))
-		comp = "z";
-	if (strstr(image->file, ".tar.bz2"))
-		comp = "j";
+	if (*compressor)
+		cmd = compressor;
 
-	ret = systemp(image, "%s c%s -f %s -C %s .",
-			get_opt("tar"),
-			comp,
-			imageoutfile(image), mountpath(image));
+	argv_add_split(&args, get_opt("tar"));
+	argv_add(&args, "c");
+	if (cmd)
+		argv_add(&args, "--use-compress-program=%s%s%s", cmd,
+				*level ? " -" : "", level);
+	if (*format)
+		argv_add(&args, "--format=%s", format);
+	if (cfg_getbool(image->imagesec, "sparse"))
+		argv_add(&args, "--sparse");
+	argv_add(&args, "-f");
+	argv_add(&args, "%s", imageoutfile(image));
+	argv_add(&args, "-C");
+	argv_add(&args, "%s", mountpath(image));
+	argv_add(&args, ".");
 
-	return ret;
+	return run_argv(image, &args);
 }
 
 static cfg_opt_t tar_opts[] = {
+	CFG_STR("compression", "", CFGF_NONE),
+	CFG_STR("compressor", "", CFGF_NONE),
+	CFG_STR("level", "", CFGF_NONE),
+	CFG_STR("format", "", CFGF_NONE),
+	CFG_BOOL("sparse", cfg_false, CFGF_NONE),
 	CFG_END()
 };
 
 struct image_handler tar_handler = {
 	.type = "tar",
+	.setup = tar_setup,
 	.generate = tar_generate,
 	.opts = tar_opts,
 };
@@ -19,22 +19,273 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "genimage.h"
+#include "crc32.h"
+
+/*
+ * UBI on-flash format, see drivers/mtd/ubi/ubi-media.h in the kernel.
+ * The image is laid out like ubinize does it: the two copies of the
+ * volume table (the layout volume) in the first two PEBs, followed by
+ * the data of each volume in order.
+ */
+#define UBI_EC_HDR_MAGIC	0x55424923	/* "UBI#" */
+#define UBI_VID_HDR_MAGIC	0x55424921	/* "UBI!" */
+#define UBI_VERSION		1
+#define UBI_HDR_SIZE		64	/* EC and VID header */
+#define UBI_HDR_SIZE_CRC	60
+#define UBI_VTBL_RECORD_SIZE	172
+#define UBI_VTBL_RECORD_SIZE_CRC 168
+#define UBI_MAX_VOLUMES		128
+#define UBI_VOL_NAME_MAX	127
+#define UBI_VID_DYNAMIC		1
+#define UBI_VID_STATIC		2
+#define UBI_VTBL_AUTORESIZE_FLG	0x01
+#define UBI_LAYOUT_VOLUME_ID	0x7fffefff
+#define UBI_LAYOUT_VOLUME_EBS	2
+#define UBI_COMPAT_REJECT	5
 
 struct ubi {
+	int vid_hdr_offs;
+	int data_offs;
+	int leb_size;
+	int max_volumes;
+	uint32_t image_seq;
 };
 
-static int ubi_generate(struct image *image)
+static void put_be16(unsigned char *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void put_be32(unsigned char *p, uint32_t v)
+{
+	put_be16(p, v >> 16);
+	put_be16(p + 2, v);
+}
+
+static void put_be64(unsigned char *p, uint64_t v)
+{
+	put_be32(p, v >> 32);
+	put_be32(p + 4, v);
+}
+
+static void ubi_ec_hdr(struct ubi *ubi, unsigned char *hdr)
+{
+	memset(hdr, 0, UBI_HDR_SIZE);
+	put_be32(hdr, UBI_EC_HDR_MAGIC);
+	hdr[4] = UBI_VERSION;
+	put_be64(hdr + 8, 0);	/* erase counter */
+	put_be32(hdr + 16, ubi->vid_hdr_offs);
+	put_be32(hdr + 20, ubi->data_offs);
+	put_be32(hdr + 24, ubi->image_seq);
+	put_be32(hdr + 60, crc32(~0, hdr, UBI_HDR_SIZE_CRC));
+}
+
+static void ubi_vid_hdr(unsigned char *hdr, int vol_type, int compat,
+		uint32_t vol_id, uint32_t lnum, uint32_t used_ebs,
+		const void *data, uint32_t data_size)
+{
+	memset(hdr, 0, UBI_HDR_SIZE);
+	put_be32(hdr, UBI_VID_HDR_MAGIC);
+	hdr[4] = UBI_VERSION;
+	hdr[5] = vol_type;
+	hdr[7] = compat;
+	put_be32(hdr + 8, vol_id);
+	put_be32(hdr + 12, lnum);
+	if (vol_type == UBI_VID_STATIC) {
+		put_be32(hdr + 20, data_size);
+		put_be32(hdr + 24, used_ebs);
+		put_be32(hdr + 32, crc32(~0, data, data_size));
+	}
+	put_be32(hdr + 60, crc32(~0, hdr, UBI_HDR_SIZE_CRC));
+}
+
+static void ubi_vtbl_record(unsigned char *rec, uint32_t reserved_pebs,
+		int vol_type, int flags, const char *name)
+{
+	size_t len = strlen(name);
+
+	memset(rec, 0, UBI_VTBL_RECORD_SIZE);
+	put_be32(rec, reserved_pebs);
+	put_be32(rec + 4, 1);	/* alignment */
+	rec[12] = vol_type;
+	put_be16(rec + 14, len);
+	memcpy(rec + 16, name, len);
+	rec[144] = flags;
+	put_be32(rec + 168, crc32(~0, rec, UBI_VTBL_RECORD_SIZE_CRC));
+}
+
+static int ubi_write(struct image *image, int fd, const void *buf, size_t size)
+{
+	ssize_t ret = write(fd, buf, size);
+
+	if (ret == (ssize_t)size)
+		return 0;
+
+	image_error(image, "write %s: %s\n", imageoutfile(image),
+			ret < 0 ? strerror(errno) : "short write");
+	return ret < 0 ? -errno : -EIO;
+}
+
+/*
+ * Write the volume data of 'file' to 'out', one PEB per LEB of data
+ */
+static int ubi_write_volume(struct image *image, int out, const char *file,
+		unsigned long long bytes, int vol_type, uint32_t vol_id,
+		unsigned char *peb)
+{
+	struct ubi *ubi = image->handler_priv;
+	int pebsize = image->flash_type->pebsize;
+	uint32_t lnum, used_ebs = (bytes + ubi->leb_size - 1) / ubi->leb_size;
+	int in, ret = 0;
+
+	in = open(file, O_RDONLY);
+	if (in < 0) {
+		ret = -errno;
+		image_error(image, "open %s: %s\n", file, strerror(errno));
+		return ret;
+	}
+
+	memset(peb, 0xff, pebsize);
+	ubi_ec_hdr(ubi, peb);
+
+	for (lnum = 0; lnum < used_ebs && !ret; lnum++) {
+		unsigned char *data = peb + ubi->data_offs;
+		size_t len = bytes < (unsigned long long)ubi->leb_size ?
+			(size_t)bytes : (size_t)ubi->leb_size;
+		ssize_t r = read(in, data, len);
+
+		if (r != (ssize_t)len) {
+			ret = r < 0 ? -errno : -EIO;
+			image_error(image, "read %s: %s\n", file,
+					r < 0 ? strerror(errno) : "short read");
+			break;
+		}
+		memset(data + len, 0xff, ubi->leb_size - len);
+		ubi_vid_hdr(peb + ubi->vid_hdr_offs, vol_type, 0, vol_id,
+				lnum, used_ebs, data, len);
+		bytes -= len;
+
+		ret = ubi_write(image, out, peb, pebsize);
+	}
+
+	close(in);
+
+	return ret;
+}
+
+static int ubi_generate_native(struct image *image)
+{
+	struct ubi *ubi = image->handler_priv;
+	int pebsize = image->flash_type->pebsize;
+	int vtbl_size = ubi->max_volumes * UBI_VTBL_RECORD_SIZE;
+	unsigned char *vtbl, *peb;
+	struct partition *part;
+	int out, i, vol_id, ret = 0;
+
+	vtbl = xzalloc(vtbl_size);
+	for (i = 0; i < ubi->max_volumes; i++)
+		put_be32(vtbl + i * UBI_VTBL_RECORD_SIZE + 168,
+				crc32(~0, vtbl + i * UBI_VTBL_RECORD_SIZE,
+					UBI_VTBL_RECORD_SIZE_CRC));
+
+	vol_id = 0;
+	list_for_each_entry(part, &image->partitions, list) {
+		struct image *child = part->image ? image_get(part->image) : NULL;
+		unsigned long long size = part->size;
+		struct stat s;
+
+		if (child && stat(imageoutfile(child), &s)) {
+			ret = -errno;
+			image_error(image, "stat %s: %s\n", imageoutfile(child),
+					strerror(errno));
+			goto out;
+		}
+		if (!size) {
+			if (!child) {
+				image_error(image, "could not find %s\n", part->image);
+				ret = -EINVAL;
+				goto out;
+			}
+			/* the configured size of a padded image, like ubinize */
+			size = child->size ? :
+				(unsigned long long)s.st_size;
+		}
+		if (child && (unsigned long long)s.st_size > size) {
+			image_error(image, "volume %s: %s is larger than the volume\n",
+					part->name, imageoutfile(child));
+			ret = -EINVAL;
+			goto out;
+		}
+
+		ubi_vtbl_record(vtbl + vol_id * UBI_VTBL_RECORD_SIZE,
+				(size + ubi->leb_size - 1) / ubi->leb_size,
+				part->read_only ? UBI_VID_STATIC : UBI_VID_DYNAMIC,
+				part->autoresize ? UBI_VTBL_AUTORESIZE_FLG : 0,
+				part->name);
+		vol_id++;
+	}
+
+	out = open(imageoutfile(image), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (out < 0) {
+		ret = -errno;
+		image_error(image, "open %s: %s\n", imageoutfile(image),
+				strerror(errno));
+		goto out;
+	}
+
+	peb = xzalloc(pebsize);
+
+	/* the layout volume, two copies of the volume table */
+	memset(peb, 0xff, pebsize);
+	memcpy(peb + ubi->data_offs, vtbl, vtbl_size);
+	ubi_ec_hdr(ubi, peb);
+	for (i = 0; i < UBI_LAYOUT_VOLUME_EBS && !ret; i++) {
+		ubi_vid_hdr(peb + ubi->vid_hdr_offs, UBI_VID_DYNAMIC,
+				UBI_COMPAT_REJECT, UBI_LAYOUT_VOLUME_ID, i, 0,
+				NULL, 0);
+		ret = ubi_write(image, out, peb, pebsize);
+	}
+
+	vol_id = 0;
+	list_for_each_entry(part, &image->partitions, list) {
+		struct image *child = part->image ? image_get(part->image) : NULL;
+		struct stat s;
+
+		if (ret)
+			break;
+		if (child && !stat(imageoutfile(child), &s))
+			ret = ubi_write_volume(image, out, imageoutfile(child),
+					s.st_size, part->read_only ?
+					UBI_VID_STATIC : UBI_VID_DYNAMIC,
+					vol_id, peb);
+		vol_id++;
+	}
+
+	free(peb);
+	if (close(out) && !ret)
+		ret = -errno;
+out:
+	free(vtbl);
+
+	return ret;
+}
+
+static int ubi_generate_ubinize(struct image *image)
 {
 	int ret;
 	FILE *fini;
 	char *tempfile;
 	int i = 0;
 	struct partition *part;
-	char *extraargs = cfg_getstr(image->imagesec, "extraargs");
+	struct argv args = {};
 
-	asprintf(&tempfile, "%s/ubifs.ini", tmppath());
+	asprintf(&tempfile, "%s/%s.ini", tmppath(), image->file);
 	if (!tempfile)
 		return -ENOMEM;
 
@@ -76,15 +327,22 @@ static int ubi_generate(struct image *image)
 
 	fclose(fini);
 
-	ret = systemp(image, "%s -s %d -O %d -p %d -m %d -o %s %s %s",
-			get_opt("ubinize"),
-			image->flash_type->sub_page_size,
-			image->flash_type->vid_header_offset,
-			image->flash_type->pebsize,
-			image->flash_type->minimum_io_unit_size,
-			imageoutfile(image),
-			tempfile,
-			extraargs);
+	argv_add_split(&args, get_opt("ubinize"));
+	argv_add(&args, "-s");
+	argv_add(&args, "%d", image->flash_type->sub_page_size);
+	argv_add(&args, "-O");
+	argv_add(&args, "%d", image->flash_type->vid_header_offset);
+	argv_add(&args, "-p");
+	argv_add(&args, "%d", image->flash_type->pebsize);
+	argv_add(&args, "-m");
+	argv_add(&args, "%d", image->flash_type->minimum_io_unit_size);
+	argv_add(&args, "-o");
+	argv_add(&args, "%s", imageoutfile(image));
+	argv_add(&args, "%s", tempfile);
+	ret = argv_add_opt(image, &args, "extraargs");
+	if (!ret)
+		ret = run_argv(image, &args);
+	argv_free(&args);
 
 err_free:
 	free(tempfile);
@@ -92,32 +350,96 @@ err_free:
 	return ret;
 }
 
+static int ubi_generate(struct image *image)
+{
+	char *extraargs = cfg_getstr(image->imagesec, "extraargs");
+
+	if (*extraargs)
+		return ubi_generate_ubinize(image);
+
+	return ubi_generate_native(image);
+}
+
 static int ubi_setup(struct image *image, cfg_t *cfg)
 {
 	struct ubi *ubi = xzalloc(sizeof(*ubi));
-	int autoresize = 0;
+	struct flash_type *flash = image->flash_type;
+	char *image_seq = cfg_getstr(cfg, "image-seq");
+	int autoresize = 0, volumes = 0, subpage, minio;
 	struct partition *part;
 
-	if (!image->flash_type) {
+	if (!flash) {
 		image_error(image, "no flash type given\n");
 		return -EINVAL;
 	}
 
 	image->handler_priv = ubi;
 
-	list_for_each_entry(part, &image->partitions, list)
+	list_for_each_entry(part, &image->partitions, list) {
 		autoresize += part->autoresize;
+		volumes++;
+		if (strlen(part->name) > UBI_VOL_NAME_MAX) {
+			image_error(image, "volume name %s is too long\n",
+					part->name);
+			return -EINVAL;
+		}
+	}
 
 	if (autoresize > 1) {
 		image_error(image, "more than one volume has the autoresize flag set\n");
 		return -EINVAL;
 	}
 
+	/* the geometry as ubinize computes it */
+	minio = flash->minimum_io_unit_size;
+	if (minio <= 0) {
+		image_error(image, "flash type %s has no minimum-io-unit-size\n",
+				flash->name);
+		return -EINVAL;
+	}
+	subpage = flash->sub_page_size > 0 ? flash->sub_page_size : minio;
+	ubi->vid_hdr_offs = flash->vid_header_offset;
+	if (!ubi->vid_hdr_offs)
+		ubi->vid_hdr_offs = (UBI_HDR_SIZE + subpage - 1) / subpage * subpage;
+	ubi->data_offs = (ubi->vid_hdr_offs + UBI_HDR_SIZE + minio - 1) / minio * minio;
+	ubi->leb_size = flash->pebsize - ubi->data_offs;
+	ubi->max_volumes = ubi->leb_size / UBI_VTBL_RECORD_SIZE;
+	if (ubi->max_volumes > UBI_MAX_VOLUMES)
+		ubi->max_volumes = UBI_MAX_VOLUMES;
+
+	if (ubi->vid_hdr_offs < UBI_HDR_SIZE || ubi->leb_size <= 0) {
+		image_error(image, "invalid flash geometry\n");
+		return -EINVAL;
+	}
+
+	if (volumes > ubi->max_volumes) {
+		image_error(image, "too many volumes, at most %d are possible\n",
+				ubi->max_volumes);
+		return -EINVAL;
+	}
+
+	/* ubinize picks a random one, keep images reproducible instead */
+	if (*image_seq) {
+		unsigned long long seq;
+		char *end;
+
+		errno = 0;
+		seq = strtoull(image_seq, &end, 0);
+		if (errno || *end || *image_seq == '-' || seq > UINT32_MAX) {
+			image_error(image, "invalid image-seq '%s'\n", image_seq);
+			return -EINVAL;
+		}
+		ubi->image_seq = seq;
+	} else {
+		ubi->image_seq = ~crc32(~0, image->file, strlen(image->file));
+	}
+
 	return 0;
 }
 
 static cfg_opt_t ubi_opts[] = {
 	CFG_STR("extraargs", "", CFGF_NONE),
+	CFG_STR("image-seq", "", CFGF_NONE),
 	CFG_END()
 };
 
@@ -126,5 +448,6 @@ struct image_handler ubi_handler = {
 	.generate = ubi_generate,
 	.setup = ubi_setup,
 	.opts = ubi_opts,
+	.no_rootpath = cfg_true,
 };
 
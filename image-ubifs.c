@@ -24,9 +24,10 @@
 
 static int ubifs_generate(struct image *image)
 {
+	struct argv args = {};
 	int max_leb_cnt;
 	int ret;
-	char *extraargs = cfg_getstr(image->imagesec, "extraargs");
+	char *compression = cfg_getstr(image->imagesec, "compression");
 	unsigned long long max_size = cfg_getint_suffix(image->imagesec, "max-size");
 
 	if (max_size)
@@ -34,14 +35,25 @@ static int ubifs_generate(struct image *image)
 	else
 		max_leb_cnt = image->size / image->flash_type->lebsize;
 
-	ret = systemp(image, "%s -d  %s -e %d -m %d -c %d -o %s %s",
-			get_opt("mkfsubifs"),
-			mountpath(image),
-			image->flash_type->lebsize,
-			image->flash_type->minimum_io_unit_size,
-			max_leb_cnt,
-			imageoutfile(image),
-			extraargs);
+	argv_add_split(&args, get_opt("mkfsubifs"));
+	argv_add(&args, "-d");
+	argv_add(&args, "%s", mountpath(image));
+	argv_add(&args, "-e");
+	argv_add(&args, "%d", image->flash_type->lebsize);
+	argv_add(&args, "-m");
+	argv_add(&args, "%d", image->flash_type->minimum_io_unit_size);
+	argv_add(&args, "-c");
+	argv_add(&args, "%d", max_leb_cnt);
+	if (*compression) {
+		argv_add(&args, "-x");
+		argv_add(&args, "%s", compression);
+	}
+	argv_add(&args, "-o");
+	argv_add(&args, "%s", imageoutfile(image));
+	ret = argv_add_opt(image, &args, "extraargs");
+	if (!ret)
+		ret = run_argv(image, &args);
+	argv_free(&args);
 
 	return ret;
 }
@@ -59,6 +71,7 @@ static int ubifs_setup(struct image *image, cfg_t *cfg)
 static cfg_opt_t ubifs_opts[] = {
 	CFG_STR("extraargs", "", CFGF_NONE),
 	CFG_STR("max-size", NULL, CFGF_NONE),
+	CFG_STR("compression", "", CFGF_NONE),
 	CFG_END()
 };
 
@@ -19,22 +19,26 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <glob.h>
+#include <libgen.h>
+#include <sys/stat.h>
 
 #include "genimage.h"
 
-static int vfat_generate(struct image *image)
+/*
+ * The 'file' and 'files' entries are put together in a directory tree
+ * first, as hardlinks or reflinked copies, directories recursively, so
+ * that a single recursive mcopy can add them, instead of one mmd per
+ * directory and one mcopy per file.
+ */
+static int vfat_stage_files(struct image *image, char **root)
 {
-	int ret;
 	struct partition *part;
-	char *extraargs = cfg_getstr(image->imagesec, "extraargs");
+	int ret;
 
-	ret = systemp(image, "%s if=/dev/zero of=\"%s\" seek=%lld count=0 bs=1 2>/dev/null",
-			get_opt("dd"), imageoutfile(image), image->size);
-	if (ret)
-		return ret;
+	asprintf(root, "%s/%s.root", tmppath(), image->file);
 
-	ret = systemp(image, "%s %s %s >/dev/null", get_opt("mkdosfs"),
-			extraargs, imageoutfile(image));
+	ret = mkdir_p(*root, 0755);
 	if (ret)
 		return ret;
 
@@ -42,31 +46,88 @@ static int vfat_generate(struct image *image)
 		struct image *child = image_get(part->image);
 		const char *file = imageoutfile(child);
 		const char *target = part->name;
-		char *path = strdupa(target);
-		char *next = path;
-
-		while ((next = strchr(next, '/')) != NULL) {
-			*next = '\0';
-			/* ignore the error: mdd fails if the target exists. */
-			systemp(image, "%s -DsS -i %s ::%s",
-				get_opt("mmd"), imageoutfile(image), path);
-			*next = '/';
-			++next;
+		struct stat s;
+		char *dest, *dir;
+
+		/* unnamed files go to the root, like 'mcopy file ::' did */
+		if (!*target) {
+			target = strrchr(child->file, '/');
+			target = target ? target + 1 : child->file;
 		}
 
 		image_log(image, 1, "adding file '%s' as '%s' ...\n",
-				child->file, *target ? target : child->file);
-		ret = systemp(image, "%s -bsp -i %s %s ::%s",
-				get_opt("mcopy"), imageoutfile(image),
-				file, target);
+				child->file, target);
+
+		asprintf(&dest, "%s/%s", *root, target);
+		dir = strdupa(dest);
+		ret = mkdir_p(dirname(dir), 0755);
+		if (!ret && stat(file, &s))
+			ret = -errno;
+		if (!ret && S_ISDIR(s.st_mode))
+			ret = copy_tree(file, dest, 0);
+		else if (!ret)
+			ret = link_file(image, file, dest);
+		free(dest);
 		if (ret)
 			return ret;
 	}
-	if (!list_empty(&image->partitions))
-		return 0;
 
-	ret = systemp(image, "%s -bsp -i %s %s/* ::", get_opt("mcopy"),
-			imageoutfile(image), mountpath(image));
+	return 0;
+}
+
+static int vfat_generate(struct image *image)
+{
+	int ret;
+	size_t i;
+	glob_t g;
+	struct argv args = {};
+	char *staged = NULL, *pattern;
+
+	ret = pad_file(image, NULL, imageoutfile(image), image->size, 0x0,
+			MODE_OVERWRITE);
+	if (ret)
+		return ret;
+
+	argv_add_split(&args, get_opt("mkdosfs"));
+	ret = argv_add_opt(image, &args, "extraargs");
+	argv_add(&args, "%s", imageoutfile(image));
+	if (!ret)
+		ret = run_argv(image, &args);
+	argv_free(&args);
+	if (ret)
+		return ret;
+
+	if (!list_empty(&image->partitions)) {
+		ret = vfat_stage_files(image, &staged);
+		if (ret)
+			goto out;
+	}
+
+	asprintf(&pattern, "%s/*", staged ? staged : mountpath(image));
+	ret = glob(pattern, 0, NULL, &g);
+	free(pattern);
+	if (ret == GLOB_NOMATCH) {
+		ret = 0;
+		goto out;
+	}
+	if (ret) {
+		ret = -EIO;
+		goto out;
+	}
+
+	argv_add_split(&args, get_opt("mcopy"));
+	argv_add(&args, "-bsp");
+	argv_add(&args, "-i");
+	argv_add(&args, "%s", imageoutfile(image));
+	for (i = 0; i < g.gl_pathc; i++)
+		argv_add(&args, "%s", g.gl_pathv[i]);
+	argv_add(&args, "::");
+	globfree(&g);
+
+	ret = run_argv(image, &args);
+out:
+	free(staged);
+
 	return ret;
 }
 
@@ -0,0 +1,285 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <confuse.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "genimage.h"
+
+/*
+ * NAND ECC as computed by the Linux software ECC engines, so that the
+ * kernel accepts the pages as written:
+ *
+ * - hamming: 3 bytes per 256 bytes, in the default (not SmartMedia)
+ *   byte order, see drivers/mtd/nand/ecc-sw-hamming.c
+ * - bch: ceil(m * strength / 8) bytes per step, see lib/bch.c and
+ *   drivers/mtd/nand/ecc-sw-bch.c. The code of an erased step is all
+ *   0xff.
+ *
+ * The BCH remainder is computed a byte at a time with a table of the
+ * remainders of all byte values.
+ */
+
+struct nand_ecc {
+	int algo;
+	int step;
+	int bytes;
+	unsigned char *table;	/* bch: 256 remainders of 'bytes' bytes */
+	unsigned char *mask;	/* bch: makes the code of erased steps 0xff */
+};
+
+enum {
+	ECC_HAMMING,
+	ECC_BCH,
+};
+
+static int parity(uint64_t v)
+{
+	return __builtin_parityll(v);
+}
+
+/*
+ * 256 byte hamming code. Row parity 2b + 1 is the parity of all bytes whose
+ * index has bit b set, 2b that of the others. Only the parity of each byte
+ * matters for those, so the indexes of the odd bytes are XORed together.
+ */
+static void hamming_calculate(const unsigned char *buf, unsigned char *code)
+{
+	unsigned int par = 0, rows = 0, all;
+	unsigned char c0 = 0, c1 = 0;
+	int i, b;
+
+	for (i = 0; i < 256; i++) {
+		par ^= buf[i];
+		if (parity(buf[i]))
+			rows ^= i;
+	}
+	all = parity(par);
+
+	for (b = 0; b < 4; b++) {
+		int set = rows >> b & 1, high = rows >> (b + 4) & 1;
+
+		c1 |= !(set ^ all) << (2 * b) | !set << (2 * b + 1);
+		c0 |= !(high ^ all) << (2 * b) | !high << (2 * b + 1);
+	}
+
+	code[0] = c0;
+	code[1] = c1;
+	code[2] = !parity(par & 0xf0) << 7 | !parity(par & 0x0f) << 6 |
+		!parity(par & 0xcc) << 5 | !parity(par & 0x33) << 4 |
+		!parity(par & 0xaa) << 3 | !parity(par & 0x55) << 2 | 3;
+}
+
+static const unsigned int bch_prim_poly[] = {
+	0x25, 0x43, 0x83, 0x11d, 0x211, 0x409, 0x805, 0x1053, 0x201b,
+	0x402b, 0x8003,
+};
+
+/*
+ * The generator polynomial of the binary BCH code over GF(2^m) correcting
+ * 't' bits: the product of (x - a^r) over the roots a^1 ... a^2t and their
+ * conjugates. Returns its degree, 'g' gets the coefficients, g[0] being
+ * that of x^0.
+ */
+static int bch_generator(int m, int t, unsigned char *g)
+{
+	int n = (1 << m) - 1, i, j, r, deg = 0;
+	unsigned int *exp, *log, *poly;
+	unsigned char *root;
+
+	exp = xzalloc((n + 1) * sizeof(*exp));
+	log = xzalloc((n + 1) * sizeof(*log));
+	poly = xzalloc((n + 1) * sizeof(*poly));
+	root = xzalloc(n);
+
+	for (i = 0, r = 1; i < n; i++) {
+		exp[i] = r;
+		log[r] = i;
+		r <<= 1;
+		if (r & (1 << m))
+			r ^= bch_prim_poly[m - 5];
+	}
+
+	for (i = 1; i <= 2 * t; i++)
+		for (r = i; !root[r]; r = (2 * r) % n)
+			root[r] = 1;
+
+	/* multiply (x + a^r) in, coefficients in GF(2^m) */
+	poly[0] = 1;
+	for (r = 0; r < n; r++) {
+		if (!root[r])
+			continue;
+		deg++;
+		for (j = deg; j >= 0; j--) {
+			unsigned int c = j ? poly[j - 1] : 0;
+
+			if (poly[j])
+				c ^= exp[(log[poly[j]] + r) % n];
+			poly[j] = c;
+		}
+	}
+
+	for (j = 0; j <= deg; j++)
+		g[j] = poly[j];
+
+	free(exp);
+	free(log);
+	free(poly);
+	free(root);
+
+	return deg;
+}
+
+/*
+ * Remainder of the message polynomial times x^ecc_bits, left-justified in
+ * 'bytes' bytes. The message starts with the most significant bit of the
+ * first byte.
+ */
+static void bch_calculate(const struct nand_ecc *ecc, const unsigned char *buf,
+		unsigned char *code)
+{
+	unsigned char r[ecc->bytes];
+	int i, j;
+
+	memset(r, 0, ecc->bytes);
+
+	for (i = 0; i < ecc->step; i++) {
+		const unsigned char *t = ecc->table + (r[0] ^ buf[i]) * ecc->bytes;
+
+		for (j = 0; j < ecc->bytes - 1; j++)
+			r[j] = r[j + 1] ^ t[j];
+		r[j] = t[j];
+	}
+
+	for (j = 0; j < ecc->bytes; j++)
+		code[j] = r[j] ^ ecc->mask[j];
+}
+
+static void bch_init(struct nand_ecc *ecc, int m, int t)
+{
+	unsigned char g[m * t + 1], *shifted, *erased;
+	int deg, bits, i, b, j;
+
+	deg = bch_generator(m, t, g);
+	ecc->bytes = (m * t + 7) / 8;
+	bits = ecc->bytes * 8;
+
+	/*
+	 * g(x) * x^pad without its leading term, left-justified: bit 0 of
+	 * the polynomial is the msb of the first byte, i.e. x^(bits - 1).
+	 */
+	shifted = xzalloc(ecc->bytes);
+	for (i = 0; i < deg; i++)
+		if (g[i]) {
+			int pos = bits - 1 - (i + bits - deg);
+
+			shifted[pos / 8] |= 0x80 >> (pos % 8);
+		}
+
+	ecc->table = xzalloc(256 * ecc->bytes);
+	for (i = 0; i < 256; i++) {
+		unsigned char *r = ecc->table + i * ecc->bytes;
+
+		r[0] = i;
+		for (b = 0; b < 8; b++) {
+			int feedback = r[0] & 0x80;
+
+			for (j = 0; j < ecc->bytes; j++)
+				r[j] = r[j] << 1 |
+					(j + 1 < ecc->bytes ? r[j + 1] >> 7 : 0);
+			if (feedback)
+				for (j = 0; j < ecc->bytes; j++)
+					r[j] ^= shifted[j];
+		}
+	}
+	free(shifted);
+
+	/* the code of an erased step, inverted */
+	ecc->mask = xzalloc(ecc->bytes);
+	erased = xzalloc(ecc->step);
+	memset(erased, 0xff, ecc->step);
+	bch_calculate(ecc, erased, ecc->mask);
+	free(erased);
+	for (j = 0; j < ecc->bytes; j++)
+		ecc->mask[j] ^= 0xff;
+}
+
+/*
+ * 'algo' is "hamming" or "bch", 'step' the number of data bytes per code,
+ * 'strength' the number of correctable bits per step for bch.
+ */
+struct nand_ecc *nand_ecc_new(const char *algo, int step, int strength)
+{
+	struct nand_ecc *ecc = xzalloc(sizeof(*ecc));
+	int m;
+
+	ecc->step = step;
+
+	if (!strcmp(algo, "hamming")) {
+		if (step != 256)
+			goto err;
+		ecc->algo = ECC_HAMMING;
+		ecc->bytes = 3;
+		return ecc;
+	}
+
+	if (strcmp(algo, "bch") || step <= 0 || strength <= 0)
+		goto err;
+
+	/* the smallest field the step and its code fit in, as Linux picks it */
+	for (m = 0; (1 + 8 * step) >> m; m++)
+		;
+	if (m < 5 || m > 15 || 8 * step + m * strength > (1 << m) - 1)
+		goto err;
+
+	ecc->algo = ECC_BCH;
+	bch_init(ecc, m, strength);
+
+	return ecc;
+err:
+	free(ecc);
+	return NULL;
+}
+
+void nand_ecc_free(struct nand_ecc *ecc)
+{
+	if (!ecc)
+		return;
+	free(ecc->table);
+	free(ecc->mask);
+	free(ecc);
+}
+
+int nand_ecc_bytes(const struct nand_ecc *ecc)
+{
+	return ecc->bytes;
+}
+
+int nand_ecc_step(const struct nand_ecc *ecc)
+{
+	return ecc->step;
+}
+
+void nand_ecc_calculate(const struct nand_ecc *ecc, const unsigned char *buf,
+		unsigned char *code)
+{
+	if (ecc->algo == ECC_HAMMING)
+		hamming_calculate(buf, code);
+	else
+		bch_calculate(ecc, buf, code);
+}
@@ -0,0 +1,303 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <confuse.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "genimage.h"
+
+/*
+ * Timing and resource usage of the phases of each image (setup, exec-pre,
+ * generate, ...) and of the tools they run. Written as a JSON summary to
+ * the file given by the 'stats' option and as Chrome trace events (for
+ * chrome://tracing or Perfetto) to the file given by 'trace'.
+ *
+ * CPU time and block I/O of phases are those of the thread running them,
+ * for tools those of the tool process. Block I/O counts only what went to
+ * or came from the block layer, not page cache hits. The RSS of a phase
+ * is the peak of the whole genimage process up to its end, so it is not
+ * specific to the image. That of a tool is its own peak.
+ */
+
+struct stats_event {
+	char *image;
+	const char *type;
+	char *name;
+	const char *cat;
+	long tid;
+	long long ts, dur;	/* us */
+	long long utime, stime;	/* us */
+	long maxrss;		/* KiB, of the process for phases */
+	long long read, written;	/* bytes of block I/O */
+};
+
+static struct stats_event *events;
+static int num_events;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec stats_t0;
+static int stats_on = -1;
+
+static long long ts_us(const struct timespec *ts)
+{
+	return (ts->tv_sec - stats_t0.tv_sec) * 1000000LL +
+		(ts->tv_nsec - stats_t0.tv_nsec) / 1000;
+}
+
+static long long tv_us(const struct timeval *tv)
+{
+	return tv->tv_sec * 1000000LL + tv->tv_usec;
+}
+
+static int stats_enabled(void)
+{
+	if (stats_on < 0) {
+		const char *stats = get_opt("stats");
+		const char *trace = get_opt("trace");
+
+		stats_on = (stats && *stats) || (trace && *trace);
+		clock_gettime(CLOCK_MONOTONIC, &stats_t0);
+	}
+
+	return stats_on;
+}
+
+void stats_start(struct stats_span *span)
+{
+	if (!stats_enabled())
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &span->start);
+	getrusage(RUSAGE_THREAD, &span->ru);
+}
+
+static void stats_add(struct image *image, const char *cat, const char *name,
+		struct stats_span *span, const struct rusage *ru,
+		const struct rusage *base)
+{
+	struct stats_event *e;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&stats_lock);
+
+	events = realloc(events, (num_events + 1) * sizeof(*events));
+	if (!events) {
+		error("out of memory\n");
+		exit(1);
+	}
+	e = &events[num_events++];
+
+	e->image = strdup(image ? image->file : "genimage");
+	e->type = image && image->handler ? image->handler->type : "";
+	e->name = strdup(name);
+	e->cat = cat;
+	e->tid = syscall(SYS_gettid);
+	e->ts = ts_us(&span->start);
+	e->dur = ts_us(&now) - e->ts;
+	e->utime = tv_us(&ru->ru_utime) - (base ? tv_us(&base->ru_utime) : 0);
+	e->stime = tv_us(&ru->ru_stime) - (base ? tv_us(&base->ru_stime) : 0);
+	e->maxrss = ru->ru_maxrss;
+	e->read = (ru->ru_inblock - (base ? base->ru_inblock : 0)) * 512LL;
+	e->written = (ru->ru_oublock - (base ? base->ru_oublock : 0)) * 512LL;
+
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+ * record a phase of 'image' which started at stats_start(span)
+ */
+void stats_stop(struct image *image, const char *name, struct stats_span *span)
+{
+	struct rusage ru;
+
+	if (!stats_enabled())
+		return;
+
+	getrusage(RUSAGE_THREAD, &ru);
+	stats_add(image, "phase", name, span, &ru, &span->ru);
+}
+
+/*
+ * record a tool run for 'image' with the resource usage from wait4()
+ */
+void stats_tool(struct image *image, const char *name, struct stats_span *span,
+		const struct rusage *ru)
+{
+	const char *base = strrchr(name, '/');
+
+	if (!stats_enabled())
+		return;
+
+	stats_add(image, "tool", base ? base + 1 : name, span, ru, NULL);
+}
+
+static void json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+static void json_event_fields(FILE *f, const struct stats_event *e)
+{
+	fprintf(f, "\"user_us\": %lld, \"sys_us\": %lld, \"%s\": %ld, "
+			"\"block_io_read_bytes\": %lld, "
+			"\"block_io_write_bytes\": %lld",
+			e->utime, e->stime,
+			strcmp(e->cat, "phase") ? "max_rss_kb" : "peak_rss_kb_so_far",
+			e->maxrss, e->read, e->written);
+}
+
+static int stats_write_summary(const char *file, long long wall)
+{
+	FILE *f;
+	int i, j, first = 1;
+
+	f = fopen(file, "w");
+	if (!f)
+		return -errno;
+
+	fprintf(f, "{\n\t\"jobs\": %d,\n\t\"wall_us\": %lld,\n\t\"images\": [",
+			get_jobs(), wall);
+
+	for (i = 0; i < num_events; i++) {
+		long long total = 0;
+		int firstev = 1;
+
+		/* one entry per image, at its first event */
+		for (j = 0; j < i; j++)
+			if (!strcmp(events[j].image, events[i].image))
+				break;
+		if (j < i)
+			continue;
+
+		for (j = i; j < num_events; j++)
+			if (!strcmp(events[j].image, events[i].image) &&
+					!strcmp(events[j].cat, "phase"))
+				total += events[j].dur;
+
+		fprintf(f, "%s\n\t\t{\n\t\t\t\"image\": ", first ? "" : ",");
+		json_string(f, events[i].image);
+		fprintf(f, ",\n\t\t\t\"type\": ");
+		json_string(f, events[i].type);
+		fprintf(f, ",\n\t\t\t\"wall_us\": %lld,\n\t\t\t\"events\": [", total);
+
+		for (j = i; j < num_events; j++) {
+			struct stats_event *e = &events[j];
+
+			if (strcmp(e->image, events[i].image))
+				continue;
+
+			fprintf(f, "%s\n\t\t\t\t{ \"%s\": ", firstev ? "" : ",",
+					e->cat);
+			json_string(f, e->name);
+			fprintf(f, ", \"start_us\": %lld, \"wall_us\": %lld, ",
+					e->ts, e->dur);
+			json_event_fields(f, e);
+			fprintf(f, " }");
+			firstev = 0;
+		}
+		fprintf(f, "\n\t\t\t]\n\t\t}");
+		first = 0;
+	}
+
+	fprintf(f, "\n\t]\n}\n");
+
+	return fclose(f) ? -errno : 0;
+}
+
+static int stats_write_trace(const char *file)
+{
+	FILE *f;
+	int i;
+
+	f = fopen(file, "w");
+	if (!f)
+		return -errno;
+
+	fprintf(f, "{ \"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+
+	for (i = 0; i < num_events; i++) {
+		struct stats_event *e = &events[i];
+
+		fprintf(f, "%s\n{ \"name\": ", i ? "," : "");
+		if (strcmp(e->cat, "phase")) {
+			json_string(f, e->name);
+		} else {
+			char *name;
+
+			asprintf(&name, "%s %s", e->name, e->image);
+			json_string(f, name);
+			free(name);
+		}
+		fprintf(f, ", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": %ld, "
+				"\"tid\": %ld, \"ts\": %lld, \"dur\": %lld, "
+				"\"args\": { \"image\": ",
+				e->cat, (long)getpid(), e->tid, e->ts, e->dur);
+		json_string(f, e->image);
+		fprintf(f, ", ");
+		json_event_fields(f, e);
+		fprintf(f, " } }");
+	}
+
+	fprintf(f, "\n] }\n");
+
+	return fclose(f) ? -errno : 0;
+}
+
+/*
+ * write the files requested with the 'stats' and 'trace' options
+ */
+int stats_write(void)
+{
+	const char *stats = get_opt("stats");
+	const char *trace = get_opt("trace");
+	struct timespec now;
+	int ret = 0;
+
+	if (!stats_enabled())
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (stats && *stats) {
+		ret = stats_write_summary(stats, ts_us(&now));
+		if (ret)
+			error("failed to write %s: %s\n", stats, strerror(-ret));
+	}
+
+	if (trace && *trace) {
+		ret = stats_write_trace(trace);
+		if (ret)
+			error("failed to write %s: %s\n", trace, strerror(-ret));
+	}
+
+	return ret;
+}
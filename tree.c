@@ -0,0 +1,572 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <confuse.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <dirent.h>
+#include <search.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+
+#include "genimage.h"
+#include "sha256.h"
+
+/*
+ * Directory tree helpers for staging the root filesystem in tmppath.
+ */
+
+/*
+ * mkdir -p
+ */
+int mkdir_p(const char *path, mode_t mode)
+{
+	char *buf = strdup(path);
+	char *p = buf;
+	int ret = 0;
+
+	while (1) {
+		char c;
+
+		p += strspn(p, "/");
+		p += strcspn(p, "/");
+		c = *p;
+		*p = '\0';
+		if (mkdir(buf, mode) && errno != EEXIST) {
+			ret = -errno;
+			error("mkdir %s: %s\n", buf, strerror(errno));
+			break;
+		}
+		if (!c)
+			break;
+		*p = c;
+	}
+
+	free(buf);
+
+	return ret;
+}
+
+static int remove_entry(const char *path, const struct stat *s, int flags,
+		struct FTW *ftw)
+{
+	if (!ftw->level)
+		return 0;
+
+	if (remove(path)) {
+		error("remove %s: %s\n", path, strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+/*
+ * rm -rf path/..., i.e. remove everything below 'path' but keep 'path'
+ */
+int remove_tree_contents(const char *path)
+{
+	int ret;
+
+	ret = nftw(path, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+	if (ret < 0 && errno == ENOENT)
+		return 0;
+	if (ret < 0)
+		return -errno;
+
+	return ret;
+}
+
+struct tree_copy {
+	int link;	/* hardlink files, cleared if not on the same filesystem */
+	void *inodes;	/* copied files with several links, by inode */
+};
+
+struct tree_inode {
+	dev_t dev;
+	ino_t ino;
+	char *path;
+};
+
+static int inode_cmp(const void *a, const void *b)
+{
+	const struct tree_inode *ia = a, *ib = b;
+
+	if (ia->dev != ib->dev)
+		return ia->dev < ib->dev ? -1 : 1;
+	if (ia->ino != ib->ino)
+		return ia->ino < ib->ino ? -1 : 1;
+	return 0;
+}
+
+static void inode_free(void *p)
+{
+	struct tree_inode *inode = p;
+
+	free(inode->path);
+	free(inode);
+}
+
+static void copy_xattrs(const char *src, const char *dst)
+{
+	char *names, *name, *value;
+	ssize_t len, vlen;
+
+	len = llistxattr(src, NULL, 0);
+	if (len <= 0)
+		return;
+
+	names = xzalloc(len);
+	len = llistxattr(src, names, len);
+
+	for (name = names; len > 0 && name < names + len; name += strlen(name) + 1) {
+		vlen = lgetxattr(src, name, NULL, 0);
+		if (vlen < 0)
+			continue;
+		value = xzalloc(vlen + 1);
+		vlen = lgetxattr(src, name, value, vlen);
+		if (vlen >= 0)
+			lsetxattr(dst, name, value, vlen, 0);
+		free(value);
+	}
+
+	free(names);
+}
+
+/*
+ * Apply owner, permissions, timestamps and xattrs of 'src' to 'dst'.
+ * Like 'cp -a', failing to set the owner as unprivileged user is not
+ * an error.
+ */
+static int copy_attributes(const char *src, const char *dst,
+		const struct stat *s)
+{
+	struct timespec times[2] = { s->st_atim, s->st_mtim };
+
+	copy_xattrs(src, dst);
+
+	if (lchown(dst, s->st_uid, s->st_gid) && errno != EPERM)
+		goto err;
+	if (!S_ISLNK(s->st_mode) && chmod(dst, s->st_mode & 07777))
+		goto err;
+	if (utimensat(AT_FDCWD, dst, times, AT_SYMLINK_NOFOLLOW))
+		goto err;
+
+	return 0;
+err:
+	error("cannot set attributes of %s: %s\n", dst, strerror(errno));
+	return -errno;
+}
+
+static int copy_regular(struct tree_copy *tc, const char *src, const char *dst,
+		const struct stat *s)
+{
+	struct tree_inode key = { .dev = s->st_dev, .ino = s->st_ino };
+	struct tree_inode **found = NULL, *inode;
+	int in, out, ret;
+
+	/* a hardlink is all it takes on the same filesystem */
+	if (tc->link) {
+		if (!link(src, dst))
+			return 0;
+		if (errno == EXDEV)
+			tc->link = 0;
+		else if (errno != EPERM)
+			goto err;
+	}
+
+	/* keep hardlinks within the tree */
+	if (s->st_nlink > 1) {
+		found = tfind(&key, &tc->inodes, inode_cmp);
+		if (found) {
+			if (!link((*found)->path, dst))
+				return 0;
+			goto err;
+		}
+	}
+
+	in = open(src, O_RDONLY);
+	if (in < 0)
+		goto err;
+
+	out = open(dst, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (out < 0) {
+		close(in);
+		goto err;
+	}
+
+	/* reflinked if the filesystem can do it */
+	ret = copy_data(in, 0, out, 0, s->st_size);
+	if (!ret)
+		ret = extend_fd(out, s->st_size);
+	close(in);
+	if (close(out) && !ret)
+		ret = -errno;
+	if (ret) {
+		error("copy %s to %s: %s\n", src, dst, strerror(-ret));
+		return ret;
+	}
+
+	if (s->st_nlink > 1) {
+		inode = xzalloc(sizeof(*inode));
+		*inode = key;
+		inode->path = strdup(dst);
+		tsearch(inode, &tc->inodes, inode_cmp);
+	}
+
+	return copy_attributes(src, dst, s);
+err:
+	error("copy %s to %s: %s\n", src, dst, strerror(errno));
+	return -errno;
+}
+
+static int copy_entry(struct tree_copy *tc, const char *src, const char *dst,
+		const struct stat *s);
+
+static int copy_dir(struct tree_copy *tc, const char *src, const char *dst,
+		const struct stat *s)
+{
+	struct dirent *d;
+	DIR *dir;
+	int ret = 0;
+
+	if (mkdir(dst, 0700) && errno != EEXIST) {
+		error("mkdir %s: %s\n", dst, strerror(errno));
+		return -errno;
+	}
+
+	dir = opendir(src);
+	if (!dir) {
+		error("opendir %s: %s\n", src, strerror(errno));
+		return -errno;
+	}
+
+	while (!ret && (d = readdir(dir))) {
+		char *from, *to;
+		struct stat cs;
+
+		if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+			continue;
+
+		asprintf(&from, "%s/%s", src, d->d_name);
+		asprintf(&to, "%s/%s", dst, d->d_name);
+
+		if (lstat(from, &cs)) {
+			ret = -errno;
+			error("stat %s: %s\n", from, strerror(errno));
+		} else {
+			ret = copy_entry(tc, from, to, &cs);
+		}
+
+		free(from);
+		free(to);
+	}
+
+	closedir(dir);
+
+	/* after the contents, so that the mtime sticks */
+	if (!ret)
+		ret = copy_attributes(src, dst, s);
+
+	return ret;
+}
+
+static int copy_entry(struct tree_copy *tc, const char *src, const char *dst,
+		const struct stat *s)
+{
+	char *target;
+	ssize_t len;
+
+	switch (s->st_mode & S_IFMT) {
+	case S_IFDIR:
+		return copy_dir(tc, src, dst, s);
+	case S_IFREG:
+		return copy_regular(tc, src, dst, s);
+	case S_IFLNK:
+		target = xzalloc(s->st_size + 1);
+		len = readlink(src, target, s->st_size + 1);
+		if (len < 0 || len > s->st_size || symlink(target, dst)) {
+			free(target);
+			break;
+		}
+		free(target);
+		return copy_attributes(src, dst, s);
+	default:
+		if (mknod(dst, s->st_mode, s->st_rdev))
+			break;
+		return copy_attributes(src, dst, s);
+	}
+
+	error("copy %s to %s: %s\n", src, dst, strerror(errno));
+	return -errno;
+}
+
+/*
+ * Like 'cp -a src dst', but regular files are reflinked where possible.
+ * With 'link', they are hardlinked when 'src' and 'dst' are on the same
+ * filesystem. This is only for copies of genimage's own staging trees:
+ * the copy must not be modified in place then, files are replaced, not
+ * rewritten.
+ */
+int copy_tree(const char *src, const char *dst, int link)
+{
+	struct tree_copy tc = {
+		.link = link,
+	};
+	struct stat s;
+	int ret;
+
+	if (lstat(src, &s)) {
+		error("stat %s: %s\n", src, strerror(errno));
+		return -errno;
+	}
+
+	ret = copy_entry(&tc, src, dst, &s);
+
+	tdestroy(tc.inodes, inode_free);
+
+	return ret;
+}
+
+/*
+ * Put 'src' at 'dst', replacing what is there: as a hardlink on the same
+ * filesystem, as a copy, reflinked where possible, otherwise. Like the
+ * copy, the link is to the file a symlink 'src' points to.
+ */
+int link_file(struct image *image, const char *src, const char *dst)
+{
+	unlink(dst);
+
+	if (!linkat(AT_FDCWD, src, AT_FDCWD, dst, AT_SYMLINK_FOLLOW))
+		return 0;
+
+	return copy_file(image, src, dst);
+}
+
+struct dedup_file {
+	char *path;
+	struct stat s;
+	unsigned char digest[SHA256_DIGEST_SIZE];
+};
+
+struct dedup {
+	struct dedup_file *files;
+	int num;
+	int *hash;	/* indexes of the files to hash */
+};
+
+static int dedup_collect(struct dedup *d, const char *path)
+{
+	struct dirent *e;
+	DIR *dir;
+	int ret = 0;
+
+	dir = opendir(path);
+	if (!dir)
+		return -errno;
+
+	while (!ret && (e = readdir(dir))) {
+		struct stat s;
+		char *sub;
+
+		if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+			continue;
+
+		asprintf(&sub, "%s/%s", path, e->d_name);
+		if (lstat(sub, &s)) {
+			ret = -errno;
+		} else if (S_ISDIR(s.st_mode)) {
+			ret = dedup_collect(d, sub);
+		} else if (S_ISREG(s.st_mode) && s.st_size &&
+				llistxattr(sub, NULL, 0) <= 0) {
+			if (!(d->num % 1024))
+				d->files = realloc(d->files,
+					(d->num + 1024) * sizeof(*d->files));
+			d->files[d->num].path = sub;
+			d->files[d->num].s = s;
+			d->num++;
+			continue;
+		}
+		free(sub);
+	}
+
+	closedir(dir);
+
+	return ret;
+}
+
+/*
+ * files can only be shared if they have the same size, mode, owner and
+ * mtime. Files with xattrs are not collected at all.
+ */
+static int dedup_attr_cmp(const struct stat *a, const struct stat *b)
+{
+	if (a->st_size != b->st_size)
+		return a->st_size < b->st_size ? -1 : 1;
+	if (a->st_mode != b->st_mode)
+		return a->st_mode < b->st_mode ? -1 : 1;
+	if (a->st_uid != b->st_uid)
+		return a->st_uid < b->st_uid ? -1 : 1;
+	if (a->st_gid != b->st_gid)
+		return a->st_gid < b->st_gid ? -1 : 1;
+	if (a->st_mtim.tv_sec != b->st_mtim.tv_sec)
+		return a->st_mtim.tv_sec < b->st_mtim.tv_sec ? -1 : 1;
+	if (a->st_mtim.tv_nsec != b->st_mtim.tv_nsec)
+		return a->st_mtim.tv_nsec < b->st_mtim.tv_nsec ? -1 : 1;
+	return 0;
+}
+
+static int dedup_cmp(const void *a, const void *b)
+{
+	const struct stat *sa = &((const struct dedup_file *)a)->s;
+	const struct stat *sb = &((const struct dedup_file *)b)->s;
+	int ret = dedup_attr_cmp(sa, sb);
+
+	if (ret)
+		return ret;
+	if (sa->st_ino != sb->st_ino)
+		return sa->st_ino < sb->st_ino ? -1 : 1;
+	return 0;
+}
+
+static int dedup_hash(void *priv, int i)
+{
+	struct dedup *d = priv;
+	struct dedup_file *f = &d->files[d->hash[i]];
+	struct sha256_ctx ctx;
+	char buf[65536];
+	ssize_t r;
+	int fd;
+
+	fd = open(f->path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	sha256_init(&ctx);
+	while ((r = read(fd, buf, sizeof(buf))) > 0)
+		sha256_update(&ctx, buf, r);
+	close(fd);
+	if (r < 0)
+		return -EIO;
+
+	sha256_final(&ctx, f->digest);
+
+	return 0;
+}
+
+/*
+ * link_file() for dedup_tree(), keeping the times of the directory, so that
+ * images of the tree stay reproducible
+ */
+static int dedup_link(struct image *image, const char *src, const char *dst)
+{
+	char *dir = strdupa(dst);
+	struct stat s;
+	int ret;
+
+	dir = dirname(dir);
+	if (lstat(dir, &s))
+		return -errno;
+
+	ret = link_file(image, src, dst);
+	if (!ret) {
+		struct timespec times[2] = { s.st_atim, s.st_mtim };
+
+		if (utimensat(AT_FDCWD, dir, times, AT_SYMLINK_NOFOLLOW))
+			ret = -errno;
+	}
+
+	return ret;
+}
+
+/*
+ * Replace regular files below 'path' which have the same contents, mode,
+ * owner and mtime, and no xattrs, by hardlinks to one of them, so that
+ * tools which keep hardlinks store the data once. Only files which have a
+ * candidate are hashed, in parallel. Files are replaced, not modified, so
+ * 'path' may be a copy made by copy_tree() with hardlinks.
+ */
+int dedup_tree(struct image *image, const char *path)
+{
+	struct dedup d = {};
+	int i, j, k, start, num = 0, linked = 0, ret;
+
+	ret = dedup_collect(&d, path);
+	if (ret)
+		goto out;
+
+	/* files with the same attributes and links to one inode are adjacent */
+	qsort(d.files, d.num, sizeof(*d.files), dedup_cmp);
+
+	d.hash = xzalloc((d.num + 1) * sizeof(*d.hash));
+	for (start = 0; start < d.num; start = i) {
+		int inodes = 1;
+
+		for (i = start + 1; i < d.num &&
+				!dedup_attr_cmp(&d.files[start].s, &d.files[i].s); i++)
+			inodes += d.files[i].s.st_ino != d.files[i - 1].s.st_ino;
+		if (inodes < 2)
+			continue;
+
+		/* the first link of each inode */
+		for (j = start; j < i; j++)
+			if (j == start || d.files[j].s.st_ino != d.files[j - 1].s.st_ino)
+				d.hash[num++] = j;
+	}
+
+	ret = run_parallel(num, dedup_hash, &d);
+	if (ret)
+		goto out;
+
+	for (start = 0, i = 0; i < num; i++) {
+		struct dedup_file *f = &d.files[d.hash[i]];
+
+		if (dedup_attr_cmp(&d.files[d.hash[start]].s, &f->s))
+			start = i;
+
+		for (j = start; j < i; j++)
+			if (!memcmp(d.files[d.hash[j]].digest, f->digest,
+						sizeof(f->digest)))
+				break;
+		if (j == i)
+			continue;
+
+		/* all links of the duplicate */
+		for (k = d.hash[i]; k < d.num &&
+				d.files[k].s.st_ino == f->s.st_ino &&
+				!dedup_attr_cmp(&d.files[k].s, &f->s); k++) {
+			ret = dedup_link(image, d.files[d.hash[j]].path,
+					d.files[k].path);
+			if (ret)
+				goto out;
+			linked++;
+		}
+	}
+
+	image_log(image, 1, "%d duplicate files replaced by hardlinks\n", linked);
+out:
+	for (i = 0; i < d.num; i++)
+		free(d.files[i].path);
+	free(d.files);
+	free(d.hash);
+
+	return ret;
+}
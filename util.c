@@ -22,7 +22,17 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <signal.h>
+#include <wordexp.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <linux/fs.h>
 
 #include "genimage.h"
 
@@ -103,13 +113,110 @@ void logmsg(int level, const char *fmt, ...)
 }
 
 /*
- * printf wrapper around 'system'
+ * Append an argument, printf style, to an argument vector
  */
-int systemp(struct image *image, const char *fmt, ...)
+void argv_add(struct argv *args, const char *fmt, ...)
+{
+	va_list va;
+
+	args->argv = realloc(args->argv, (args->argc + 2) * sizeof(char *));
+	if (!args->argv) {
+		error("out of memory\n");
+		exit(1);
+	}
+
+	va_start(va, fmt);
+	if (vasprintf(&args->argv[args->argc], fmt, va) < 0) {
+		error("out of memory\n");
+		exit(1);
+	}
+	va_end(va);
+
+	args->argv[++args->argc] = NULL;
+}
+
+static pthread_mutex_t wordexp_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* wordexp() is not thread-safe, images are generated in parallel */
+static int split_words(struct argv *args, const char *str)
+{
+	wordexp_t we;
+	size_t i;
+	int ret;
+
+	pthread_mutex_lock(&wordexp_lock);
+	ret = wordexp(str, &we, WRDE_NOCMD | WRDE_SHOWERR);
+	if (!ret) {
+		for (i = 0; i < we.we_wordc; i++)
+			argv_add(args, "%s", we.we_wordv[i]);
+		wordfree(&we);
+	}
+	pthread_mutex_unlock(&wordexp_lock);
+
+	return ret;
+}
+
+/*
+ * Append the words of 'str', split and unquoted like the shell does but
+ * without running commands. Used for tool names from the config.
+ */
+int argv_add_split(struct argv *args, const char *str)
+{
+	if (!str || !*str)
+		return 0;
+
+	if (split_words(args, str)) {
+		error("cannot split '%s' into arguments\n", str);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Like argv_add_split() for the option 'opt' of the image, e.g.
+ * extraargs. Errors name the option.
+ */
+int argv_add_opt(struct image *image, struct argv *args, const char *opt)
+{
+	const char *str = cfg_getstr(image->imagesec, opt);
+	int ret;
+
+	if (!str || !*str)
+		return 0;
+
+	ret = split_words(args, str);
+	if (ret == WRDE_BADCHAR) {
+		image_error(image, "%s: '%s' contains one of |&;<>(){} or a "
+				"newline, quote it or leave it out, the "
+				"arguments are not passed through a shell\n",
+				opt, str);
+		return -EINVAL;
+	}
+	if (ret) {
+		image_error(image, "%s: cannot split '%s' into arguments\n",
+				opt, str);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+void argv_free(struct argv *args)
+{
+	int i;
+
+	for (i = 0; i < args->argc; i++)
+		free(args->argv[i]);
+	free(args->argv);
+	args->argv = NULL;
+	args->argc = 0;
+}
+
+static void cmd_log(struct image *image, int failed, const char *fmt, ...)
 {
 	va_list args;
 	char *buf;
-	int ret;
 
 	va_start (args, fmt);
 
@@ -117,25 +224,283 @@ int systemp(struct image *image, const char *fmt, ...)
 
 	va_end (args);
 
-	if (!buf)
-		return -ENOMEM;
+	if (failed && image)
+		image_error(image, "%s", buf);
+	else if (failed)
+		error("%s", buf);
+	else if (image)
+		image_log(image, 2, "%s", buf);
+	else
+		logmsg(2, "%s", buf);
 
-	if (image)
-		image_log(image, 2, "cmd: %s\n", buf);
+	free(buf);
+}
+
+/*
+ * Run the command in 'args' and free it. The command is spawned directly,
+ * without a shell. Its output is collected and logged as a whole, so that
+ * the output of commands running in parallel is not interleaved. It is
+ * shown in verbose mode or when the command fails, i.e. exits with a
+ * status above 'ok_status'.
+ *
+ * Returns the exit status of the command, 128 + the signal number if it was
+ * killed or a negative error code if it could not be run.
+ */
+int run_argv(struct image *image, struct argv *args)
+{
+	posix_spawn_file_actions_t actions;
+	char *out = NULL, *cmd = NULL, *line, *next;
+	size_t outlen = 0, cmdlen = 0;
+	struct stats_span span;
+	struct rusage ru;
+	FILE *f;
+	int pipefd[2], status, failed, i, ret;
+	pid_t pid;
+
+	f = open_memstream(&cmd, &cmdlen);
+	for (i = 0; i < args->argc; i++)
+		fprintf(f, "%s%s", i ? " " : "", args->argv[i]);
+	fclose(f);
+
+	cmd_log(image, 0, "cmd: %s\n", cmd);
+
+	if (!args->argc) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (pipe2(pipefd, O_CLOEXEC)) {
+		ret = -errno;
+		goto out;
+	}
+
+	stats_start(&span);
+
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDOUT_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDERR_FILENO);
+
+	ret = posix_spawnp(&pid, args->argv[0], &actions, NULL, args->argv,
+			args->envp ? : environ);
+
+	posix_spawn_file_actions_destroy(&actions);
+	close(pipefd[1]);
+
+	if (ret) {
+		close(pipefd[0]);
+		cmd_log(image, 1, "failed to run %s: %s\n", args->argv[0],
+				strerror(ret));
+		ret = -ret;
+		goto out;
+	}
+
+	f = open_memstream(&out, &outlen);
+	while (1) {
+		char buf[4096];
+		ssize_t r = read(pipefd[0], buf, sizeof(buf));
+
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		fwrite(buf, 1, r, f);
+	}
+	fclose(f);
+	close(pipefd[0]);
+
+	while (wait4(pid, &status, 0, &ru) < 0) {
+		if (errno != EINTR) {
+			ret = -errno;
+			goto out;
+		}
+	}
+
+	stats_tool(image, args->argv[0], &span, &ru);
+
+	if (WIFEXITED(status))
+		ret = WEXITSTATUS(status);
 	else
-		logmsg(2, "cmd: %s\n", buf);
+		ret = 128 + WTERMSIG(status);
 
-	ret = system(buf);
+	failed = ret > args->ok_status;
 
-	if (ret > 0)
-		ret = WEXITSTATUS(ret);
+	for (line = out; line && *line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		cmd_log(image, failed, "%s: %s\n", args->argv[0], line);
+	}
 
-	free(buf);
+	if (failed)
+		cmd_log(image, 1, "%s exited with %s %d\n", args->argv[0],
+				WIFEXITED(status) ? "status" : "signal",
+				WIFEXITED(status) ? ret : ret - 128);
+
+	cmd_log(image, 0, "cmd: %s: %ld.%03lds user, %ld.%03lds system, %ld KiB max RSS\n",
+			args->argv[0],
+			(long)ru.ru_utime.tv_sec, (long)ru.ru_utime.tv_usec / 1000,
+			(long)ru.ru_stime.tv_sec, (long)ru.ru_stime.tv_usec / 1000,
+			ru.ru_maxrss);
+out:
+	free(out);
+	free(cmd);
+	argv_free(args);
+
+	return ret;
+}
+
+/*
+ * Start the command in 'args' as a filter: it reads what is written to
+ * filter->fd and writes to 'outfile'. Its stderr is passed through. SIGPIPE
+ * is blocked in the calling thread until filter_close(), so that a dying
+ * filter shows up as EPIPE from write().
+ */
+int filter_open(struct image *image, struct filter *filter, struct argv *args,
+		const char *outfile)
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	char *cmd = NULL;
+	size_t cmdlen = 0;
+	sigset_t pipeset;
+	FILE *f;
+	int pipefd[2], out, ret, i;
+
+	filter->args = *args;
+	filter->fd = -1;
+	*args = (struct argv){};
+
+	f = open_memstream(&cmd, &cmdlen);
+	for (i = 0; i < filter->args.argc; i++)
+		fprintf(f, "%s ", filter->args.argv[i]);
+	fclose(f);
+	cmd_log(image, 0, "cmd: %s> %s\n", cmd, outfile);
+	free(cmd);
+
+	if (!filter->args.argc)
+		return -EINVAL;
+
+	out = open(outfile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (out < 0) {
+		ret = -errno;
+		image_error(image, "open %s: %s\n", outfile, strerror(errno));
+		return ret;
+	}
+
+	if (pipe2(pipefd, O_CLOEXEC)) {
+		ret = -errno;
+		close(out);
+		return ret;
+	}
+
+	sigemptyset(&pipeset);
+	sigaddset(&pipeset, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipeset, &filter->sigmask);
+
+	stats_start(&filter->span);
+
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, pipefd[0], STDIN_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &filter->sigmask);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+	ret = posix_spawnp(&filter->pid, filter->args.argv[0], &actions, &attr,
+			filter->args.argv, environ);
+
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	close(pipefd[0]);
+	close(out);
+
+	if (ret) {
+		close(pipefd[1]);
+		pthread_sigmask(SIG_SETMASK, &filter->sigmask, NULL);
+		cmd_log(image, 1, "failed to run %s: %s\n",
+				filter->args.argv[0], strerror(ret));
+		argv_free(&filter->args);
+		return -ret;
+	}
+
+	filter->fd = pipefd[1];
+
+	return 0;
+}
+
+/*
+ * Close the input of a filter started with filter_open() and wait for it.
+ * Returns its exit status like run_argv().
+ */
+int filter_close(struct image *image, struct filter *filter)
+{
+	struct timespec zero = {};
+	struct rusage ru;
+	sigset_t pipeset;
+	int status, ret;
+
+	if (filter->fd < 0)
+		return -EINVAL;
+
+	close(filter->fd);
+	filter->fd = -1;
+
+	while (wait4(filter->pid, &status, 0, &ru) < 0) {
+		if (errno != EINTR) {
+			ret = -errno;
+			goto out;
+		}
+	}
+
+	stats_tool(image, filter->args.argv[0], &filter->span, &ru);
+
+	if (WIFEXITED(status))
+		ret = WEXITSTATUS(status);
+	else
+		ret = 128 + WTERMSIG(status);
+
+	if (ret > filter->args.ok_status)
+		cmd_log(image, 1, "%s exited with %s %d\n", filter->args.argv[0],
+				WIFEXITED(status) ? "status" : "signal",
+				WIFEXITED(status) ? ret : ret - 128);
+out:
+	/* drop a SIGPIPE raised while writing to a dead filter */
+	sigemptyset(&pipeset);
+	sigaddset(&pipeset, SIGPIPE);
+	while (sigtimedwait(&pipeset, NULL, &zero) > 0)
+		;
+	pthread_sigmask(SIG_SETMASK, &filter->sigmask, NULL);
+	argv_free(&filter->args);
 
 	return ret;
 }
 
+/*
+ * printf wrapper around 'sh -c', for commands which need a shell
+ */
+int systemp(struct image *image, const char *fmt, ...)
+{
+	struct argv args = {};
+	va_list va;
+	char *buf;
+
+	va_start (va, fmt);
+
+	vasprintf(&buf, fmt, va);
+
+	va_end (va);
+
+	if (!buf)
+		return -ENOMEM;
 
+	argv_add(&args, "/bin/sh");
+	argv_add(&args, "-c");
+	argv_add(&args, "%s", buf);
+
+	free(buf);
+
+	return run_argv(image, &args);
+}
 
 /*
  * bidirectional process communication
@@ -287,86 +652,323 @@ static size_t min(size_t a, size_t b)
 	return a < b ? a : b;
 }
 
-int pad_file(struct image *image, const char *infile, const char *outfile,
-		size_t size, unsigned char fillpattern, enum pad_mode mode)
+static int is_zero(const unsigned char *buf, size_t len)
+{
+	return !len || (!buf[0] && !memcmp(buf, buf + 1, len - 1));
+}
+
+#define COPY_BUF_SIZE	(1024 * 1024)
+
+/*
+ * copy with pread/pwrite. Blocks of zeroes are skipped.
+ */
+static int copy_buffered(int in, off_t inoff, int out, off_t outoff, size_t size)
 {
-	FILE *f = NULL, *outf = NULL;
-	void *buf = NULL;
-	int now, r, w;
+	unsigned char *buf = xzalloc(COPY_BUF_SIZE);
 	int ret = 0;
 
-	if (infile) {
-		f = fopen(infile, "r");
-		if (!f) {
-			image_error(image, "open %s: %s\n", infile, strerror(errno));
-			ret = -errno;
-			goto err_out;
+	while (size) {
+		size_t now = min(size, COPY_BUF_SIZE);
+		size_t pos = 0, start;
+		ssize_t r;
+
+		r = pread(in, buf, now, inoff);
+		if (r <= 0) {
+			ret = r < 0 ? -errno : -EIO;
+			break;
+		}
+
+		while (pos < (size_t)r) {
+			size_t blk = min(r - pos, 4096);
+
+			if (is_zero(buf + pos, blk)) {
+				pos += blk;
+				continue;
+			}
+			start = pos;
+			while (pos < (size_t)r && !is_zero(buf + pos, min(r - pos, 4096)))
+				pos += min(r - pos, 4096);
+			if (pwrite(out, buf + start, pos - start, outoff + start) !=
+					(ssize_t)(pos - start)) {
+				ret = -errno;
+				goto out;
+			}
 		}
+
+		inoff += r;
+		outoff += r;
+		size -= r;
 	}
+out:
+	free(buf);
 
-	outf = fopen(outfile, mode == MODE_OVERWRITE ? "w" : "a");
-	if (!outf) {
-		image_error(image, "open %s: %s\n", outfile, strerror(errno));
-		ret = -errno;
-		goto err_out;
+	return ret;
+}
+
+/*
+ * Copy a range of data, letting the kernel do the work if possible:
+ * a reflink shares the blocks on file systems which support it,
+ * copy_file_range() and sendfile() avoid copying through userspace.
+ */
+static int copy_range(int in, off_t inoff, int out, off_t outoff, size_t size)
+{
+	ssize_t r;
+
+#ifdef FICLONERANGE
+	struct file_clone_range range = {
+		.src_fd = in,
+		.src_offset = inoff,
+		.src_length = size,
+		.dest_offset = outoff,
+	};
+
+	if (!ioctl(out, FICLONERANGE, &range))
+		return 0;
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+	while (size) {
+		r = copy_file_range(in, &inoff, out, &outoff, size, 0);
+		if (r <= 0)
+			break;
+		size -= r;
 	}
+	if (!size)
+		return 0;
+#endif
 
-	buf = xzalloc(4096);
+	if (lseek(out, outoff, SEEK_SET) < 0)
+		return -errno;
 
-	if (!infile) {
-		struct stat s;
-		ret = stat(outfile, &s);
-		if (ret)
-			goto err_out;
-		if ((unsigned long long)s.st_size > size) {
-			ret = -EINVAL;
-			goto err_out;
+	while (size) {
+		r = sendfile(out, in, &inoff, min(size, 0x7ffff000));
+		if (r <= 0)
+			break;
+		outoff += r;
+		size -= r;
+	}
+	if (!size)
+		return 0;
+
+	return copy_buffered(in, inoff, out, outoff, size);
+}
+
+/*
+ * Copy 'size' bytes from 'in' at 'inoff' to 'out' at 'outoff'. Holes in
+ * the input are skipped, so the destination range must read as zeroes
+ * already, e.g. because it is beyond the end of the file. The size of
+ * 'out' is not adjusted if the input ends with a hole.
+ */
+int copy_data(int in, off_t inoff, int out, off_t outoff, size_t size)
+{
+	off_t end = inoff + size, data, hole;
+	int ret;
+
+	while (inoff < end) {
+		data = lseek(in, inoff, SEEK_DATA);
+		if (data < 0) {
+			/* nothing but a hole left */
+			if (errno == ENXIO)
+				break;
+			data = inoff;
+			hole = end;
+		} else {
+			hole = lseek(in, data, SEEK_HOLE);
+			if (hole < 0)
+				hole = end;
 		}
-		size = size - s.st_size;
-		goto fill;
+		if (data >= end)
+			break;
+		if (hole > end)
+			hole = end;
+
+		ret = copy_range(in, data, out, outoff + (data - inoff), hole - data);
+		if (ret)
+			return ret;
+
+		outoff += hole - inoff;
+		inoff = hole;
 	}
 
+	return 0;
+}
+
+/*
+ * fill 'size' bytes of 'fd' at 'offset' with 'fillpattern'. Zeroes are
+ * not written, the range must read as zeroes already.
+ */
+int insert_fill(int fd, off_t offset, size_t size, unsigned char fillpattern)
+{
+	void *buf;
+	int ret = 0;
+
+	if (!fillpattern)
+		return 0;
+
+	buf = xzalloc(min(size, COPY_BUF_SIZE));
+	memset(buf, fillpattern, min(size, COPY_BUF_SIZE));
+
 	while (size) {
-		now = min(size, 4096);
+		size_t now = min(size, COPY_BUF_SIZE);
 
-		r = fread(buf, 1, now, f);
-		w = fwrite(buf, 1, r, outf);
-		if (w < r) {
+		if (pwrite(fd, buf, now, offset) != (ssize_t)now) {
 			ret = -errno;
-			goto err_out;
+			break;
 		}
-		size -= r;
+		offset += now;
+		size -= now;
+	}
+
+	free(buf);
+
+	return ret;
+}
+
+int extend_fd(int fd, off_t size)
+{
+	struct stat s;
+
+	if (fstat(fd, &s))
+		return -errno;
 
-		if (r < now)
-			goto fill;
+	if (s.st_size < size && ftruncate(fd, size))
+		return -errno;
+
+	return 0;
+}
+
+/*
+ * Copy 'infile' into 'fd' at 'offset' and pad it with 'fillpattern' up to
+ * 'size' bytes. The range must read as zeroes before, which is the case
+ * for holes and for the area beyond the end of the file.
+ */
+int insert_image(struct image *image, int fd, const char *infile,
+		size_t size, off_t offset, unsigned char fillpattern)
+{
+	struct stat s;
+	int in, ret;
+
+	in = open(infile, O_RDONLY);
+	if (in < 0) {
+		image_error(image, "open %s: %s\n", infile, strerror(errno));
+		return -errno;
+	}
+
+	if (fstat(in, &s)) {
+		ret = -errno;
+		goto out;
 	}
 
-	now = fread(buf, 1, 1, f);
-	if (now == 1) {
+	if ((unsigned long long)s.st_size > size) {
 		image_error(image, "input file '%s' too large\n", infile);
 		ret = -EINVAL;
-		goto err_out;
+		goto out;
 	}
 
-fill:
-	memset(buf, fillpattern, 4096);
+	ret = copy_data(in, 0, fd, offset, s.st_size);
+	if (ret) {
+		image_error(image, "copy %s: %s\n", infile, strerror(-ret));
+		goto out;
+	}
 
-	while (size) {
-		now = min(size, 4096);
+	ret = insert_fill(fd, offset + s.st_size, size - s.st_size, fillpattern);
+	if (ret)
+		goto out;
 
-		r = fwrite(buf, 1, now, outf);
-		if (r < now) {
-			ret = -errno;
-			goto err_out;
-		}
-		size -= now;
+	ret = extend_fd(fd, offset + size);
+out:
+	close(in);
+
+	return ret;
+}
+
+/*
+ * Copy 'infile' to the end of 'outfile' and pad with 'fillpattern' up to
+ * 'size' bytes. Without 'infile', 'outfile' is padded to 'size' bytes.
+ * Holes and runs of zeroes, including zero padding, are not written but
+ * turned into holes.
+ */
+int pad_file(struct image *image, const char *infile, const char *outfile,
+		size_t size, unsigned char fillpattern, enum pad_mode mode)
+{
+	struct stat s;
+	int out;
+	int ret = 0;
+
+	out = open(outfile, O_WRONLY | O_CREAT |
+			(mode == MODE_OVERWRITE ? O_TRUNC : 0), 0666);
+	if (out < 0) {
+		image_error(image, "open %s: %s\n", outfile, strerror(errno));
+		return -errno;
 	}
+
+	if (fstat(out, &s)) {
+		ret = -errno;
+		goto err_out;
+	}
+
+	if (infile) {
+		ret = insert_image(image, out, infile, size, s.st_size,
+				fillpattern);
+		goto err_out;
+	}
+
+	if ((unsigned long long)s.st_size > size) {
+		ret = -EINVAL;
+		goto err_out;
+	}
+
+	ret = insert_fill(out, s.st_size, size - s.st_size, fillpattern);
+	if (ret)
+		goto err_out;
+
+	ret = extend_fd(out, size);
 err_out:
-	free(buf);
-	if (f)
-		fclose(f);
-	if (outf)
-		fclose(outf);
+	if (close(out) && !ret)
+		ret = -errno;
+
+	return ret;
+}
+
+/*
+ * copy 'src' to 'dst'. 'dst' is removed first, so that a file it may
+ * be hardlinked with is not modified.
+ */
+int copy_file(struct image *image, const char *src, const char *dst)
+{
+	struct stat s;
+	int in, out, ret;
+
+	in = open(src, O_RDONLY);
+	if (in < 0) {
+		image_error(image, "open %s: %s\n", src, strerror(errno));
+		return -errno;
+	}
+
+	if (fstat(in, &s)) {
+		ret = -errno;
+		close(in);
+		return ret;
+	}
+
+	unlink(dst);
+	out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, s.st_mode & 0777);
+	if (out < 0) {
+		ret = -errno;
+		image_error(image, "open %s: %s\n", dst, strerror(errno));
+		close(in);
+		return ret;
+	}
+
+	ret = copy_data(in, 0, out, 0, s.st_size);
+	if (!ret)
+		ret = extend_fd(out, s.st_size);
+	if (ret)
+		image_error(image, "copy %s to %s: %s\n", src, dst, strerror(-ret));
+
+	close(in);
+	if (close(out) && !ret)
+		ret = -errno;
 
 	return ret;
 }
@@ -409,3 +1011,85 @@ err_out:
 
 	return ret;
 }
+
+struct parallel {
+	int (*fn)(void *priv, int i);
+	void *priv;
+	int num;
+	int next;
+	int ret;
+	pthread_mutex_t lock;
+};
+
+static void *parallel_worker(void *arg)
+{
+	struct parallel *p = arg;
+	int i, ret;
+
+	while (1) {
+		pthread_mutex_lock(&p->lock);
+		if (p->ret || p->next == p->num) {
+			pthread_mutex_unlock(&p->lock);
+			break;
+		}
+		i = p->next++;
+		pthread_mutex_unlock(&p->lock);
+
+		ret = p->fn(p->priv, i);
+		if (ret) {
+			pthread_mutex_lock(&p->lock);
+			if (!p->ret)
+				p->ret = ret;
+			pthread_mutex_unlock(&p->lock);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Call 'fn' for 'i' from 0 to 'num' - 1, from up to get_jobs() threads.
+ * No new calls are started once one of them failed.
+ */
+int run_parallel(int num, int (*fn)(void *priv, int i), void *priv)
+{
+	struct parallel p = {
+		.fn = fn,
+		.priv = priv,
+		.num = num,
+	};
+	pthread_t *threads;
+	int i, jobs = get_jobs();
+
+	if (jobs > num)
+		jobs = num;
+
+	if (jobs <= 1) {
+		for (i = 0; i < num; i++) {
+			int ret = fn(priv, i);
+			if (ret)
+				return ret;
+		}
+		return 0;
+	}
+
+	pthread_mutex_init(&p.lock, NULL);
+	threads = xzalloc(jobs * sizeof(*threads));
+
+	for (i = 0; i < jobs; i++) {
+		if (pthread_create(&threads[i], NULL, parallel_worker, &p))
+			break;
+	}
+
+	/* if no thread could be started, do the work here */
+	if (!i)
+		parallel_worker(&p);
+
+	while (i--)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+	pthread_mutex_destroy(&p.lock);
+
+	return p.ret;
+}
@@ -0,0 +1,669 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <confuse.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <endian.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "genimage.h"
+
+/*
+ * A virtual disk is described by the pieces it is assembled from: data
+ * in memory (partition tables) and files placed at an offset (partition
+ * images). Everything else reads as zeroes. The encoders below write
+ * the disk directly from this description in a single pass, so that the
+ * raw disk image is never created. Only the extents which carry data
+ * are read at all, the gaps are encoded without looking at them.
+ */
+
+struct vdisk_segment {
+	unsigned long long offset;
+	unsigned long long size;
+	unsigned char *data;
+	int fd;
+};
+
+struct vdisk_extent {
+	unsigned long long start, end;
+};
+
+struct vdisk {
+	unsigned long long size;
+	struct vdisk_segment *segments;
+	int num_segments;
+	struct vdisk_extent *extents;
+	int num_extents;
+};
+
+#define DIV_ROUND_UP(n, d)	(((n) + (d) - 1) / (d))
+
+static void *xrealloc(void *ptr, size_t size)
+{
+	ptr = realloc(ptr, size);
+	if (!ptr) {
+		error("out of memory\n");
+		exit(1);
+	}
+
+	return ptr;
+}
+
+struct vdisk *vdisk_new(unsigned long long size)
+{
+	struct vdisk *vd = xzalloc(sizeof(*vd));
+
+	vd->size = size;
+
+	return vd;
+}
+
+void vdisk_free(struct vdisk *vd)
+{
+	int i;
+
+	for (i = 0; i < vd->num_segments; i++) {
+		free(vd->segments[i].data);
+		if (vd->segments[i].fd >= 0)
+			close(vd->segments[i].fd);
+	}
+	free(vd->segments);
+	free(vd->extents);
+	free(vd);
+}
+
+static struct vdisk_segment *vdisk_add_segment(struct vdisk *vd,
+		unsigned long long offset, unsigned long long size)
+{
+	struct vdisk_segment *seg;
+
+	vd->segments = xrealloc(vd->segments,
+			(vd->num_segments + 1) * sizeof(*seg));
+	seg = &vd->segments[vd->num_segments++];
+	seg->offset = offset;
+	seg->size = size;
+	seg->data = NULL;
+	seg->fd = -1;
+
+	return seg;
+}
+
+static void vdisk_add_extent(struct vdisk *vd, unsigned long long start,
+		unsigned long long end)
+{
+	struct vdisk_extent *e;
+
+	if (end <= start)
+		return;
+
+	vd->extents = xrealloc(vd->extents,
+			(vd->num_extents + 1) * sizeof(*e));
+	e = &vd->extents[vd->num_extents++];
+	e->start = start;
+	e->end = end;
+}
+
+/*
+ * place a copy of 'size' bytes of 'data' at 'offset'
+ */
+void vdisk_add_data(struct vdisk *vd, const void *data, size_t size,
+		unsigned long long offset)
+{
+	struct vdisk_segment *seg = vdisk_add_segment(vd, offset, size);
+
+	seg->data = xzalloc(size);
+	memcpy(seg->data, data, size);
+	vdisk_add_extent(vd, offset, offset + size);
+}
+
+/*
+ * place the contents of 'file' at 'offset'. The file must not be larger
+ * than 'size'. Holes in the file are gaps of the disk.
+ */
+int vdisk_add_file(struct vdisk *vd, const char *file, unsigned long long size,
+		unsigned long long offset)
+{
+	struct vdisk_segment *seg;
+	off_t data, hole = 0;
+	struct stat s;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &s)) {
+		close(fd);
+		return -errno;
+	}
+
+	if ((unsigned long long)s.st_size > size) {
+		close(fd);
+		return -EFBIG;
+	}
+
+	seg = vdisk_add_segment(vd, offset, s.st_size);
+	seg->fd = fd;
+
+	while (hole < s.st_size) {
+		data = lseek(fd, hole, SEEK_DATA);
+		if (data < 0) {
+			if (errno == ENXIO)
+				break;
+			/* no hole detection, everything is data */
+			data = hole;
+			hole = s.st_size;
+		} else {
+			hole = lseek(fd, data, SEEK_HOLE);
+			if (hole < 0 || hole > s.st_size)
+				hole = s.st_size;
+		}
+		vdisk_add_extent(vd, offset + data, offset + hole);
+	}
+
+	return 0;
+}
+
+/*
+ * read 'size' bytes of the disk at 'offset'
+ */
+static int vdisk_read(struct vdisk *vd, unsigned char *buf, size_t size,
+		unsigned long long offset)
+{
+	int i;
+
+	memset(buf, 0, size);
+
+	for (i = 0; i < vd->num_segments; i++) {
+		struct vdisk_segment *seg = &vd->segments[i];
+		unsigned long long start, end;
+
+		start = seg->offset > offset ? seg->offset : offset;
+		end = seg->offset + seg->size;
+		if (end > offset + size)
+			end = offset + size;
+		if (start >= end)
+			continue;
+
+		if (seg->data) {
+			memcpy(buf + start - offset, seg->data + start - seg->offset,
+					end - start);
+			continue;
+		}
+
+		while (start < end) {
+			ssize_t r = pread(seg->fd, buf + start - offset, end - start,
+					start - seg->offset);
+			if (r < 0)
+				return -errno;
+			if (r == 0)
+				return -EIO;
+			start += r;
+		}
+	}
+
+	return 0;
+}
+
+static int vdisk_extent_cmp(const void *a, const void *b)
+{
+	const struct vdisk_extent *ea = a, *eb = b;
+
+	if (ea->start != eb->start)
+		return ea->start < eb->start ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Turn the extents into sorted, non-overlapping ranges of blocks of
+ * 'blocksize' bytes
+ */
+static void vdisk_map(struct vdisk *vd, unsigned long long blocksize)
+{
+	unsigned long long blocks = DIV_ROUND_UP(vd->size, blocksize);
+	int i, num = 0;
+
+	for (i = 0; i < vd->num_extents; i++) {
+		struct vdisk_extent *e = &vd->extents[i];
+
+		e->start /= blocksize;
+		e->end = DIV_ROUND_UP(e->end, blocksize);
+		if (e->end > blocks)
+			e->end = blocks;
+	}
+
+	qsort(vd->extents, vd->num_extents, sizeof(*vd->extents),
+			vdisk_extent_cmp);
+
+	for (i = 0; i < vd->num_extents; i++) {
+		struct vdisk_extent *e = &vd->extents[i];
+
+		if (e->start >= e->end)
+			continue;
+		if (num && e->start <= vd->extents[num - 1].end) {
+			if (e->end > vd->extents[num - 1].end)
+				vd->extents[num - 1].end = e->end;
+			continue;
+		}
+		vd->extents[num++] = *e;
+	}
+
+	vd->num_extents = num;
+}
+
+/*
+ * check whether 'buf' consists of a repeated 32 bit pattern
+ */
+static int is_uniform(const void *buf, size_t size, uint32_t *pattern)
+{
+	const uint32_t *p = buf;
+	size_t i;
+
+	for (i = 1; i < size / 4; i++)
+		if (p[i] != p[0])
+			return 0;
+
+	*pattern = p[0];
+
+	return 1;
+}
+
+static int vdisk_pwrite(struct image *image, int fd, const void *buf,
+		size_t size, off_t offset)
+{
+	if (pwrite(fd, buf, size, offset) != (ssize_t)size) {
+		image_error(image, "write %s: %s\n", imageoutfile(image),
+				strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+/*
+ * Android sparse images, as used by fastboot
+ */
+
+#define SPARSE_HEADER_MAGIC	0xed26ff3a
+#define SPARSE_BLOCK_SIZE	4096
+#define CHUNK_TYPE_RAW		0xcac1
+#define CHUNK_TYPE_FILL		0xcac2
+#define CHUNK_TYPE_DONT_CARE	0xcac3
+
+struct sparse_header {
+	uint32_t magic;
+	uint16_t major_version;
+	uint16_t minor_version;
+	uint16_t file_hdr_sz;
+	uint16_t chunk_hdr_sz;
+	uint32_t blk_sz;
+	uint32_t total_blks;
+	uint32_t total_chunks;
+	uint32_t image_checksum;
+} __attribute__((packed));
+
+struct sparse_chunk_header {
+	uint16_t chunk_type;
+	uint16_t reserved1;
+	uint32_t chunk_sz;
+	uint32_t total_sz;
+} __attribute__((packed));
+
+struct sparse {
+	struct image *image;
+	int fd;
+	off_t pos;		/* end of the finished chunks */
+	uint16_t type;		/* the chunk being assembled */
+	uint32_t fill;
+	uint32_t blocks;
+	uint32_t num_chunks;
+};
+
+static int sparse_flush(struct sparse *sp)
+{
+	struct sparse_chunk_header chunk;
+	size_t size = sizeof(chunk);
+	int ret;
+
+	if (!sp->blocks)
+		return 0;
+
+	if (sp->type == CHUNK_TYPE_RAW)
+		size += (size_t)sp->blocks * SPARSE_BLOCK_SIZE;
+	else if (sp->type == CHUNK_TYPE_FILL)
+		size += sizeof(sp->fill);
+
+	chunk.chunk_type = htole16(sp->type);
+	chunk.reserved1 = 0;
+	chunk.chunk_sz = htole32(sp->blocks);
+	chunk.total_sz = htole32(size);
+
+	ret = vdisk_pwrite(sp->image, sp->fd, &chunk, sizeof(chunk), sp->pos);
+	if (!ret && sp->type == CHUNK_TYPE_FILL)
+		ret = vdisk_pwrite(sp->image, sp->fd, &sp->fill, sizeof(sp->fill),
+				sp->pos + sizeof(chunk));
+
+	sp->pos += size;
+	sp->blocks = 0;
+	sp->num_chunks++;
+
+	return ret;
+}
+
+/*
+ * Append 'blocks' blocks of the given type. Consecutive blocks of the same
+ * type end up in one chunk, raw data is written right away behind the
+ * space left for the chunk header.
+ */
+static int sparse_add(struct sparse *sp, uint16_t type, uint32_t fill,
+		const void *data, uint32_t blocks)
+{
+	int ret;
+
+	if (sp->blocks && (sp->type != type ||
+			(type == CHUNK_TYPE_FILL && sp->fill != fill) ||
+			sp->blocks + blocks < sp->blocks)) {
+		ret = sparse_flush(sp);
+		if (ret)
+			return ret;
+	}
+
+	sp->type = type;
+	sp->fill = fill;
+
+	if (type == CHUNK_TYPE_RAW) {
+		ret = vdisk_pwrite(sp->image, sp->fd, data,
+				(size_t)blocks * SPARSE_BLOCK_SIZE,
+				sp->pos + sizeof(struct sparse_chunk_header) +
+				(off_t)sp->blocks * SPARSE_BLOCK_SIZE);
+		if (ret)
+			return ret;
+	}
+
+	sp->blocks += blocks;
+
+	return 0;
+}
+
+#define SPARSE_READ_BLOCKS	256
+
+int vdisk_write_android_sparse(struct image *image, struct vdisk *vd)
+{
+	const char *outfile = imageoutfile(image);
+	struct sparse_header header;
+	struct sparse sp = {
+		.image = image,
+	};
+	unsigned long long blocks = DIV_ROUND_UP(vd->size, SPARSE_BLOCK_SIZE);
+	unsigned long long block = 0;
+	unsigned char *buf;
+	int i, ret = 0;
+
+	if (blocks > UINT32_MAX) {
+		image_error(image, "too large for an android sparse image\n");
+		return -EFBIG;
+	}
+
+	sp.fd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (sp.fd < 0) {
+		image_error(image, "open %s: %s\n", outfile, strerror(errno));
+		return -errno;
+	}
+
+	vdisk_map(vd, SPARSE_BLOCK_SIZE);
+
+	buf = xzalloc(SPARSE_READ_BLOCKS * SPARSE_BLOCK_SIZE);
+	sp.pos = sizeof(header);
+
+	for (i = 0; i <= vd->num_extents && !ret; i++) {
+		unsigned long long start = i < vd->num_extents ?
+				vd->extents[i].start : blocks;
+		unsigned long long end = i < vd->num_extents ?
+				vd->extents[i].end : blocks;
+
+		/* the gap before the extent */
+		if (start > block)
+			ret = sparse_add(&sp, CHUNK_TYPE_DONT_CARE, 0, NULL,
+					start - block);
+
+		for (block = start; block < end && !ret; ) {
+			uint32_t num = end - block > SPARSE_READ_BLOCKS ?
+					SPARSE_READ_BLOCKS : end - block;
+			uint32_t j = 0;
+
+			ret = vdisk_read(vd, buf, num * SPARSE_BLOCK_SIZE,
+					block * SPARSE_BLOCK_SIZE);
+			if (ret) {
+				image_error(image, "read: %s\n", strerror(-ret));
+				break;
+			}
+
+			/* split into runs of raw blocks and of uniform blocks */
+			while (j < num && !ret) {
+				unsigned char *b = buf + j * SPARSE_BLOCK_SIZE;
+				uint32_t fill, next, n = 1;
+
+				if (is_uniform(b, SPARSE_BLOCK_SIZE, &fill)) {
+					while (j + n < num && is_uniform(b + n * SPARSE_BLOCK_SIZE,
+							SPARSE_BLOCK_SIZE, &next) && next == fill)
+						n++;
+					ret = sparse_add(&sp, CHUNK_TYPE_FILL, fill, NULL, n);
+				} else {
+					while (j + n < num && !is_uniform(b + n * SPARSE_BLOCK_SIZE,
+							SPARSE_BLOCK_SIZE, &next))
+						n++;
+					ret = sparse_add(&sp, CHUNK_TYPE_RAW, 0, b, n);
+				}
+				j += n;
+			}
+			block += num;
+		}
+	}
+
+	if (!ret)
+		ret = sparse_flush(&sp);
+
+	if (!ret) {
+		header.magic = htole32(SPARSE_HEADER_MAGIC);
+		header.major_version = htole16(1);
+		header.minor_version = htole16(0);
+		header.file_hdr_sz = htole16(sizeof(struct sparse_header));
+		header.chunk_hdr_sz = htole16(sizeof(struct sparse_chunk_header));
+		header.blk_sz = htole32(SPARSE_BLOCK_SIZE);
+		header.total_blks = htole32(blocks);
+		header.total_chunks = htole32(sp.num_chunks);
+		header.image_checksum = 0;
+		ret = vdisk_pwrite(image, sp.fd, &header, sizeof(header), 0);
+	}
+
+	if (!ret && ftruncate(sp.fd, sp.pos))
+		ret = -errno;
+
+	free(buf);
+	if (close(sp.fd) && !ret)
+		ret = -errno;
+
+	return ret;
+}
+
+/*
+ * qcow2 images (version 2) with 64k clusters. Clusters without data are
+ * left unallocated and read as zeroes. The metadata is sized up front
+ * from the extents, the data clusters follow it in disk order.
+ */
+
+#define QCOW2_MAGIC		0x514649fb	/* "QFI\xfb" */
+#define QCOW2_CLUSTER_BITS	16
+#define QCOW2_CLUSTER_SIZE	(1ULL << QCOW2_CLUSTER_BITS)
+#define QCOW2_OFLAG_COPIED	(1ULL << 63)
+
+struct qcow2_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t backing_file_offset;
+	uint32_t backing_file_size;
+	uint32_t cluster_bits;
+	uint64_t size;
+	uint32_t crypt_method;
+	uint32_t l1_size;
+	uint64_t l1_table_offset;
+	uint64_t refcount_table_offset;
+	uint32_t refcount_table_clusters;
+	uint32_t nb_snapshots;
+	uint64_t snapshots_offset;
+} __attribute__((packed));
+
+int vdisk_write_qcow2(struct image *image, struct vdisk *vd)
+{
+	const unsigned long long cs = QCOW2_CLUSTER_SIZE;
+	const unsigned long long l2_entries = cs / sizeof(uint64_t);
+	const unsigned long long rc_entries = cs / sizeof(uint16_t);
+	const char *outfile = imageoutfile(image);
+	unsigned long long clusters = DIV_ROUND_UP(vd->size, cs);
+	unsigned long long l1_size = DIV_ROUND_UP(clusters, l2_entries);
+	unsigned long long l1c, l2c = 0, rtc = 1, rbc = 1, data = 0, used;
+	unsigned long long l1_offset, rt_offset, rb_offset, l2_offset, pos;
+	unsigned long long c, last = ~0ULL;
+	uint64_t *l1, *l2, *rt;
+	uint16_t *rb;
+	struct qcow2_header header;
+	unsigned char *buf;
+	uint32_t fill;
+	int i, fd, ret = 0;
+
+	vdisk_map(vd, cs);
+
+	/* upper bounds for the data clusters and the L2 tables needed */
+	for (i = 0; i < vd->num_extents; i++) {
+		data += vd->extents[i].end - vd->extents[i].start;
+		for (c = vd->extents[i].start; c < vd->extents[i].end;
+				c = (c / l2_entries + 1) * l2_entries) {
+			if (c / l2_entries != last)
+				l2c++;
+			last = c / l2_entries;
+		}
+	}
+
+	l1c = DIV_ROUND_UP(l1_size * sizeof(uint64_t), cs);
+	if (!l1c)
+		l1c = 1;
+
+	/* the refcounts cover themselves as well */
+	while (1) {
+		unsigned long long total = 1 + l1c + rtc + rbc + l2c + data;
+		unsigned long long nrbc = DIV_ROUND_UP(total, rc_entries);
+		unsigned long long nrtc = DIV_ROUND_UP(nrbc * sizeof(uint64_t), cs);
+
+		if (nrbc == rbc && nrtc == rtc)
+			break;
+		rbc = nrbc;
+		rtc = nrtc;
+	}
+
+	l1_offset = cs;
+	rt_offset = l1_offset + l1c * cs;
+	rb_offset = rt_offset + rtc * cs;
+	l2_offset = rb_offset + rbc * cs;
+	pos = l2_offset + l2c * cs;
+
+	fd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		image_error(image, "open %s: %s\n", outfile, strerror(errno));
+		return -errno;
+	}
+
+	l1 = xzalloc(l1c * cs);
+	l2 = xzalloc(l2c ? l2c * cs : 1);
+	rt = xzalloc(rtc * cs);
+	rb = xzalloc(rbc * cs);
+	buf = xzalloc(cs);
+
+	l2c = 0;
+	last = ~0ULL;
+	for (i = 0; i < vd->num_extents && !ret; i++) {
+		for (c = vd->extents[i].start; c < vd->extents[i].end; c++) {
+			uint64_t *table;
+
+			if (c / l2_entries != last) {
+				last = c / l2_entries;
+				l1[last] = htobe64((l2_offset + l2c * cs) | QCOW2_OFLAG_COPIED);
+				l2c++;
+			}
+			table = l2 + (l2c - 1) * l2_entries;
+
+			ret = vdisk_read(vd, buf, cs, c * cs);
+			if (ret) {
+				image_error(image, "read: %s\n", strerror(-ret));
+				break;
+			}
+
+			if (is_uniform(buf, cs, &fill) && !fill)
+				continue;
+
+			ret = vdisk_pwrite(image, fd, buf, cs, pos);
+			if (ret)
+				break;
+
+			table[c % l2_entries] = htobe64(pos | QCOW2_OFLAG_COPIED);
+			pos += cs;
+		}
+	}
+
+	if (ret)
+		goto out;
+
+	used = pos / cs;
+	for (c = 0; c < used; c++)
+		rb[c] = htobe16(1);
+	for (c = 0; c < rbc; c++)
+		rt[c] = htobe64(rb_offset + c * cs);
+
+	memset(&header, 0, sizeof(header));
+	header.magic = htobe32(QCOW2_MAGIC);
+	header.version = htobe32(2);
+	header.cluster_bits = htobe32(QCOW2_CLUSTER_BITS);
+	header.size = htobe64(vd->size);
+	header.l1_size = htobe32(l1_size);
+	header.l1_table_offset = htobe64(l1_offset);
+	header.refcount_table_offset = htobe64(rt_offset);
+	header.refcount_table_clusters = htobe32(rtc);
+
+	ret = vdisk_pwrite(image, fd, &header, sizeof(header), 0);
+	if (!ret)
+		ret = vdisk_pwrite(image, fd, l1, l1c * cs, l1_offset);
+	if (!ret)
+		ret = vdisk_pwrite(image, fd, rt, rtc * cs, rt_offset);
+	if (!ret)
+		ret = vdisk_pwrite(image, fd, rb, rbc * cs, rb_offset);
+	if (!ret && l2c)
+		ret = vdisk_pwrite(image, fd, l2, l2c * cs, l2_offset);
+	if (!ret && ftruncate(fd, pos))
+		ret = -errno;
+out:
+	free(buf);
+	free(rb);
+	free(rt);
+	free(l2);
+	free(l1);
+	if (close(fd) && !ret)
+		ret = -errno;
+
+	return ret;
+}